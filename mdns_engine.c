@@ -0,0 +1,1168 @@
+//
+// MIT License
+//
+// Copyright 2024 <>< Charles Lohr
+//
+// Packet engine for minimdnsd.  See LICENSE for full text.
+//
+
+#include <string.h>
+#include <arpa/inet.h>
+#include "mdns_engine.h"
+
+// MDNS functions from esp32xx
+
+uint8_t * ParseMDNSPath( uint8_t * dat, uint8_t * dataend, char * topop, int * len )
+{
+	int l;
+	int j;
+
+	*len = 0;
+
+	while(dat != dataend)
+	{
+		// See how long the string we should read is.
+		l = *(dat++);
+
+		// Zero-length strings indicate end-of-string.
+		if( l == 0 )
+			break;
+
+		if( *len + l + 1 >= MAX_MDNS_PATH || l > dataend - dat )
+			return 0;
+
+		//If not our first time through, add a '.'
+		if( *len != 0 )
+		{
+			*(topop++) = '.';
+			(*len)++;
+		}
+
+		for( j = 0; j < l; j++ )
+		{
+			if( dat[j] >= 'A' && dat[j] <= 'Z' )
+				topop[j] = dat[j] - 'A' + 'a';
+			else
+				topop[j] = dat[j];
+		}
+
+		// Move along in the string, if there are more strings to concatenate.
+		topop += l;
+		dat += l;
+		*len += l;
+	}
+
+	*topop = 0; //Null terminate.
+	return dat;
+}
+
+uint8_t * MDNSReadName( uint8_t * pkt, uint8_t * dat, uint8_t * dataend, char * topop )
+{
+	uint8_t * after = 0;
+	int len = 0;
+	int jumps = 0;
+
+	for( ;; )
+	{
+		if( dat >= dataend ) return 0;
+
+		int l = *(dat++);
+
+		if( l == 0 )
+			break;
+
+		if( ( l & 0xc0 ) == 0xc0 )
+		{
+			// Compression pointer, from the start of the packet.
+			if( dat >= dataend || jumps++ > 16 ) return 0;
+			if( !after ) after = dat + 1;
+			dat = pkt + ( ( ( l & 0x3f ) << 8 ) | *dat );
+			continue;
+		}
+
+		if( len + l + 1 >= MAX_MDNS_PATH || l > dataend - dat )
+			return 0;
+
+		if( len != 0 )
+			topop[len++] = '.';
+
+		int j;
+		for( j = 0; j < l; j++ )
+		{
+			uint8_t c = dat[j];
+			topop[len++] = ( c >= 'A' && c <= 'Z' ) ? c - 'A' + 'a' : c;
+		}
+		dat += l;
+	}
+
+	topop[len] = 0;
+	return after ? after : dat;
+}
+
+int IsAddressLocal( const struct in_addr * testaddr )
+{
+	uint32_t check = ntohl( testaddr->s_addr );
+	if ( ( check & 0xff000000 ) == 0x7f000000 ) return 1; // 127.x.x.x (Link Local, but still want to join)
+	if ( ( check & 0xff000000 ) == 0x0a000000 ) return 1; // 10.x.x.x
+	if ( ( check & 0xfff00000 ) == 0xac100000 ) return 1; // 172.[16-31].x.x
+	if ( ( check & 0xffff0000 ) == 0xc0a80000 ) return 1; // 192.168.x.x
+	if ( ( check & 0xffff0000 ) == 0xa9fe0000 ) return 1; // 169.254.x.x (RFC5735)
+	return 0;
+}
+
+#ifndef DISABLE_IPV6
+int IsAddress6Local( const struct in6_addr * addr )
+{
+	return IN6_IS_ADDR_LINKLOCAL( addr ) || IN6_IS_ADDR_SITELOCAL( addr );
+}
+#endif
+
+const struct mdns_iface * MDNSFindIface( const struct mdns_responder * resp, int ifindex )
+{
+	int i;
+	for( i = 0; i < resp->num_ifaces; i++ )
+	{
+		if( resp->ifaces[i].ifindex == ifindex )
+			return &resp->ifaces[i];
+	}
+	return 0;
+}
+
+// Is this "hostname.local"?
+static int IsOurName( const struct mdns_responder * resp, const char * path )
+{
+	return resp->hostname[0] && memcmp( path, resp->hostname, resp->hostnamelen ) == 0 &&
+		strcmp( path + resp->hostnamelen, ".local" ) == 0;
+}
+
+static int IsOurAddress( const struct mdns_responder * resp, int type, const uint8_t * rdata )
+{
+	int i, j;
+	for( i = 0; i < resp->num_ifaces; i++ )
+	{
+		const struct mdns_iface * iface = &resp->ifaces[i];
+		for( j = 0; type == 1 && j < iface->num4; j++ )
+			if( memcmp( &iface->addr4[j], rdata, 4 ) == 0 ) return 1;
+#ifndef DISABLE_IPV6
+		for( j = 0; type == 28 && j < iface->num6; j++ )
+			if( memcmp( &iface->addr6[j], rdata, 16 ) == 0 ) return 1;
+#endif
+	}
+	return 0;
+}
+
+// One of the host's addresses that we don't answer with.
+static int IsHostAddress( const struct mdns_responder * resp, int type, const uint8_t * rdata )
+{
+	struct in6_addr addr = { { { 0,0,0,0,0,0,0,0,0,0,0xff,0xff } } };
+	int i;
+	if( type == 1 )
+		memcpy( &addr.s6_addr[12], rdata, 4 );
+	else
+		memcpy( &addr, rdata, 16 );
+	for( i = 0; i < resp->num_host_addrs; i++ )
+		if( memcmp( &resp->host_addrs[i], &addr, 16 ) == 0 ) return 1;
+	return 0;
+}
+
+// Turns "4.3.2.1.in-addr.arpa" or "(32 nibbles).ip6.arpa" into an address.
+// Returns 1 (A) or 28 (AAAA) for the kind of address, or 0 if it isn't one.
+static int ParseReverseName( const char * path, int pathlen, uint8_t * addr )
+{
+	int i;
+	if( pathlen > 13 && strcmp( path + pathlen - 13, ".in-addr.arpa" ) == 0 )
+	{
+		const char * p = path;
+		for( i = 3; i >= 0; i-- )
+		{
+			int v = 0, digits = 0;
+			while( *p >= '0' && *p <= '9' && digits < 3 )
+			{
+				v = v * 10 + ( *(p++) - '0' );
+				digits++;
+			}
+			if( !digits || v > 255 || *(p++) != '.' ) return 0;
+			addr[i] = v;
+		}
+		return ( p == path + pathlen - 12 ) ? 1 : 0;
+	}
+#ifndef DISABLE_IPV6
+	else if( pathlen == 64 + 8 && strcmp( path + 64, "ip6.arpa" ) == 0 )
+	{
+		for( i = 0; i < 32; i++ )
+		{
+			char c = path[i*2];
+			int v = ( c >= '0' && c <= '9' ) ? c - '0' : ( c >= 'a' && c <= 'f' ) ? c - 'a' + 10 : -1;
+			if( v < 0 || path[i*2+1] != '.' ) return 0;
+			if( i & 1 )
+				addr[15 - i/2] |= v << 4;
+			else
+				addr[15 - i/2] = v;
+		}
+		return 28;
+	}
+#endif
+	return 0;
+}
+
+static uint8_t * WriteTTL( uint8_t * obptr, uint32_t ttl )
+{
+	*(obptr++) = ttl >> 24; *(obptr++) = ttl >> 16;
+	*(obptr++) = ttl >> 8;  *(obptr++) = ttl;
+	return obptr;
+}
+
+static uint8_t * WriteHostName( const struct mdns_responder * resp, uint8_t * obptr )
+{
+	const char * s = resp->hostname;
+	const char * end = s + resp->hostnamelen;
+
+	// Hostnames could, in theory, have dots in them.
+	while( s < end )
+	{
+		const char * e = s;
+		while( e < end && *e != '.' ) e++;
+		*(obptr++) = e - s;
+		memcpy( obptr, s, e - s );
+		obptr += e - s;
+		s = ( e < end ) ? e + 1 : e;
+	}
+	memcpy( obptr, "\5local", 7 );
+	return obptr + 7;
+}
+
+#ifdef MDNS_LOOKUPS
+// Writes a dotted name out as labels, or returns 0 if it doesn't fit.
+static uint8_t * WriteDottedName( uint8_t * obptr, uint8_t * obend, const char * name )
+{
+	while( *name )
+	{
+		const char * e = name;
+		while( *e && *e != '.' ) e++;
+		if( e - name > 63 || obend - obptr < e - name + 2 ) return 0;
+		*(obptr++) = e - name;
+		memcpy( obptr, name, e - name );
+		obptr += e - name;
+		name = *e ? e + 1 : e;
+	}
+	if( obend - obptr < 1 ) return 0;
+	*(obptr++) = 0;
+	return obptr;
+}
+
+// DNS clients put exactly one question in, uncompressed.  Returns a pointer
+// past the question, or 0 if there isn't one.
+static uint8_t * ParseQuestion( uint8_t * query, int querylen, char * path, int * qtype )
+{
+	int stlen;
+	if( querylen < 12 || ntohs( ((uint16_t*)query)[2] ) < 1 ) return 0;
+	uint8_t * dataend = query + querylen;
+	uint8_t * dataptr = ParseMDNSPath( query + 12, dataend, path, &stlen );
+	if( !dataptr || dataend - dataptr < 4 ) return 0;
+	*qtype = ( dataptr[0] << 8 ) | dataptr[1];
+	return dataptr + 4;
+}
+
+static int IsAnswerFor( const struct mdns_record * rec, const char * qname, int qtype )
+{
+	return strcmp( rec->name, qname ) == 0 &&
+		( rec->type == qtype || qtype == 255 || rec->type == 5 /*CNAME*/ );
+}
+
+static int IsReverseLocal( int revtype, uint8_t * revaddr )
+{
+#ifndef DISABLE_IPV6
+	if( revtype == 28 ) return IsAddress6Local( (struct in6_addr*)revaddr );
+#endif
+	return revtype == 1 && IsAddressLocal( (struct in_addr*)revaddr );
+}
+
+static struct mdns_record * AddRecord( struct mdns_answers * set, const char * name, int type, uint32_t ttl )
+{
+	if( set->count >= set->max ) return 0;
+	struct mdns_record * rec = &set->records[set->count++];
+	strcpy( rec->name, name );
+	rec->type = type;
+	rec->ttl = ttl;
+	rec->rdlen = 0;
+	return rec;
+}
+
+// All our addresses, for a resolver client asking for our own name.
+static void AddLocalRecords( const struct mdns_responder * resp, const char * name, struct mdns_answers * set )
+{
+	int i, j;
+	for( i = 0; i < resp->num_ifaces; i++ )
+	{
+		const struct mdns_iface * iface = &resp->ifaces[i];
+		for( j = 0; j < iface->num4; j++ )
+		{
+			struct mdns_record * rec = AddRecord( set, name, 1, resp->ttl );
+			if( !rec ) return;
+			memcpy( rec->rdata, &iface->addr4[j], 4 );
+			rec->rdlen = 4;
+		}
+#ifndef DISABLE_IPV6
+		for( j = 0; j < iface->num6 && !resp->is_ipv4_only; j++ )
+		{
+			struct mdns_record * rec = AddRecord( set, name, 28, resp->ttl );
+			if( !rec ) return;
+			memcpy( rec->rdata, &iface->addr6[j], 16 );
+			rec->rdlen = 16;
+		}
+#endif
+	}
+}
+
+static int ProcessResolverQuery( const struct mdns_responder * resp, const struct mdns_rxinfo * rx, uint8_t * in, int inlen, uint8_t * out, int * outlen )
+{
+	char path[MAX_MDNS_PATH];
+	int qtype;
+	struct mdns_record local[8];
+	struct mdns_answers set = { 0, 8, local };
+
+	if( !ParseQuestion( in, inlen, path, &qtype ) )
+		return MDNS_ACTION_NONE;
+
+	int pathlen = strlen( path );
+	uint8_t revaddr[16];
+	int revtype = ParseReverseName( path, pathlen, revaddr );
+
+	if( IsOurName( resp, path ) )
+	{
+		// Answered from our own tables, if there's no record of that type, it's NODATA.
+		AddLocalRecords( resp, path, &set );
+	}
+	else if( revtype && IsOurAddress( resp, revtype, revaddr ) && resp->hostname[0] )
+	{
+		struct mdns_record * rec = AddRecord( &set, path, 12, resp->ttl );
+		rec->rdlen = WriteHostName( resp, rec->rdata ) - rec->rdata;
+	}
+	else if( ( pathlen > 6 && strcmp( path + pathlen - 6, ".local" ) == 0 ) ||
+		( revtype && IsReverseLocal( revtype, revaddr ) ) )
+	{
+		// If we are resolving, just yolo this off to the rest of the network.
+		return MDNS_ACTION_FORWARD;
+	}
+	else
+	{
+		// Not ours to answer, so the client can go ask someone else.
+		*outlen = MDNSBuildDNSResponse( in, inlen, &set, 5 /*REFUSED*/, rx->is_stream, out, MDNS_MAX_PACKET );
+		return *outlen ? MDNS_ACTION_UNICAST : MDNS_ACTION_NONE;
+	}
+
+	MDNSRankAnswers( resp, &set );
+	*outlen = MDNSBuildDNSResponse( in, inlen, &set, 0, rx->is_stream, out, MDNS_MAX_PACKET );
+	return *outlen ? MDNS_ACTION_UNICAST : MDNS_ACTION_NONE;
+}
+#endif
+
+int MDNSProcessPacket( const struct mdns_responder * resp, const struct mdns_rxinfo * rx,
+	uint8_t * in, int inlen, uint8_t * out, int * outlen )
+{
+	char path[MAX_MDNS_PATH];
+	int i, stlen;
+
+	*outlen = 0;
+
+	if( inlen < 12 )
+	{
+		// Runt packet - can't do anything with these.
+		return MDNS_ACTION_NONE;
+	}
+
+	uint16_t * psr = (uint16_t*)in;
+	uint16_t flags = ntohs( psr[1] );
+	uint16_t questions = ntohs( psr[2] );
+	// We discard answers.
+	//uint16_t answers = ntohs( psr[3] );
+
+	// Tricky - index 12 bytes in, we can do a direct reply.
+	uint8_t * dataptr = in + 12;
+	uint8_t * dataend = in + inlen;
+
+	// MDNS reply (we are a server, not a client, so discard).
+	if( flags & 0x8000 )
+		return MDNS_ACTION_NONE;
+
+	if( rx->is_resolver )
+#ifdef MDNS_LOOKUPS
+		return ProcessResolverQuery( resp, rx, in, inlen, out, outlen );
+#else
+		return MDNS_ACTION_NONE;
+#endif
+
+	// All answers go into one reply, after the 12 byte header.
+	uint8_t * obptr = out + 12;
+	uint8_t * obend = out + MDNS_MAX_PACKET;
+	int answers = 0;
+
+	//Query
+	for( i = 0; i < questions; i++ )
+	{
+		uint8_t * namestartptr = dataptr;
+		//Work our way through.
+		dataptr = ParseMDNSPath( dataptr, dataend, path, &stlen );
+
+		// Make sure there is still room left for the rest of the record.
+		if( !dataptr || dataend - dataptr < 4 ) break;
+
+		uint16_t record_type = ( dataptr[0] << 8 ) | dataptr[1];
+
+		// Record class is not used.
+		//uint16_t record_class = ( dataptr[2] << 8 ) | dataptr[3];
+
+		// Skip over type and class to the next question.
+		dataptr += 4;
+
+		int pathlen = strlen( path );
+
+		// Reverse lookups, answered from our interface table for our own addresses.
+		uint8_t revaddr[16];
+		int revtype = ParseReverseName( path, pathlen, revaddr );
+		if( revtype )
+		{
+			if( record_type != 12 /*PTR*/ && record_type != 255 ) continue;
+
+			if( IsOurAddress( resp, revtype, revaddr ) )
+			{
+				// Name, terminator, type, class, TTL, length, and hostname.local
+				if( resp->hostname[0] && obend - obptr >= stlen + 2 + 10 + resp->hostnamelen + 8 )
+				{
+					memcpy( obptr, namestartptr, stlen+1 );
+					obptr += stlen+1;
+					*(obptr++) = 0;
+					*(obptr++) = 0x00; *(obptr++) = 0x0c; // PTR record
+					*(obptr++) = 0x80; *(obptr++) = 0x01; //Flush cache + in ptr.
+					obptr = WriteTTL( obptr, resp->ttl );
+					uint8_t * rdlen = obptr;
+					obptr = WriteHostName( resp, obptr + 2 );
+					rdlen[0] = 0; rdlen[1] = obptr - rdlen - 2;
+					answers++;
+				}
+			}
+			continue;
+		}
+
+		if( pathlen < 6 || strcmp( path + pathlen - 6, ".local" ) != 0 ) continue;
+
+		const char * path_first_dot = path;
+		const char * cpp = path;
+		while( *cpp && *cpp != '.' ) cpp++;
+		int dotlen = 0;
+		if( *cpp == '.' )
+		{
+			path_first_dot = cpp+1;
+			dotlen = path_first_dot - path - 1;
+		}
+		else
+			path_first_dot = 0;
+
+		if( resp->hostname[0] && dotlen && dotlen == resp->hostnamelen && memcmp( resp->hostname, path, dotlen ) == 0 )
+		{
+			// ANY (255) is how peers probe for a name, answer those to defend it.
+			int sendA = ( ( record_type == 1 /*A*/ || record_type == 255 ) && rx->ipv4_valid );
+#ifndef DISABLE_IPV6
+			int sendAAAA = ( ( record_type == 28 /*AAAA*/ || record_type == 255 ) && rx->ipv6_valid && !sendA );
+
+			// If it came in on the multicast address, answer with the interface's own address.
+			const struct in6_addr * addr6 = &rx->local_addr_6;
+			if( sendAAAA && IN6_IS_ADDR_MULTICAST( addr6 ) )
+			{
+				const struct mdns_iface * iface = MDNSFindIface( resp, rx->rxinterface );
+				if( iface && iface->num6 )
+					addr6 = &iface->addr6[0];
+				else
+					sendAAAA = 0;
+			}
+#else
+			int sendAAAA = 0;
+#endif
+
+			// Name, terminator, type, class, TTL, length, and up to 16 bytes of address.
+			if( ( sendA || sendAAAA ) && obend - obptr >= stlen + 2 + 10 + 16 )
+			{
+				// Answer
+				memcpy( obptr, namestartptr, stlen+1 ); //Hack: Copy the name in.
+				obptr += stlen+1;
+				*(obptr++) = 0;
+				*(obptr++) = 0x00; *(obptr++) = (sendA ? 0x01 : 0x1c ); // A record
+				*(obptr++) = 0x80; *(obptr++) = 0x01; //Flush cache + in ptr.
+				obptr = WriteTTL( obptr, resp->ttl );
+
+				if( sendA )
+				{
+					*(obptr++) = 0x00; *(obptr++) = 0x04; //Size 4 (IP)
+					memcpy( obptr, &rx->local_addr_4.s_addr, 4 );
+					obptr+=4;
+				}
+#ifndef DISABLE_IPV6
+				else if( sendAAAA )
+				{
+					*(obptr++) = 0x00; *(obptr++) = 0x10; //Size 16 (IPv6)
+					memcpy( obptr, addr6->s6_addr, 16 );
+					obptr+=16;
+				}
+#endif
+				answers++;
+			}
+		}
+	}
+
+	if( answers )
+	{
+		uint16_t * obb = (uint16_t*)out;
+		*(obb++) = psr[0];        // Transaction ID, as it came in.
+		*(obb++) = htons(0x8400); //Authortative response.
+		*(obb++) = 0;
+		*(obb++) = htons( answers );
+		*(obb++) = 0;
+		*(obb++) = 0;
+		*outlen = obptr - out;
+		return MDNS_ACTION_REPLY;
+	}
+
+	// We could also reply with services here.
+
+	return MDNS_ACTION_NONE;
+}
+
+int MDNSBuildRecords( const struct mdns_responder * resp, const struct mdns_iface * iface,
+	int kind, uint8_t * out, int outmax )
+{
+	int is_probe = ( kind == MDNS_BUILD_PROBE );
+	int num6 = 0;
+#ifndef DISABLE_IPV6
+	if( !resp->is_ipv4_only ) num6 = iface->num6;
+#endif
+	int records = iface->num4 + num6;
+	int i;
+
+	// Header, name, question, and worst case 28 bytes per record.
+	if( !resp->hostname[0] || !records || outmax < 12 + resp->hostnamelen + 8 + 4 + records * 28 )
+		return 0;
+
+	uint16_t * obb = (uint16_t*)out;
+	*(obb++) = 0;
+	*(obb++) = is_probe ? 0 : htons( 0x8400 );
+	*(obb++) = htons( is_probe ? 1 : 0 );
+	*(obb++) = htons( is_probe ? 0 : records );
+	*(obb++) = htons( is_probe ? records : 0 );
+	*(obb++) = 0;
+
+	uint8_t * obptr = WriteHostName( resp, out + 12 );
+
+	if( is_probe )
+	{
+		// Question for ANY, and ask for a unicast response (QU bit).
+		*(obptr++) = 0x00; *(obptr++) = 0xff;
+		*(obptr++) = 0x80; *(obptr++) = 0x01;
+	}
+
+	for( i = 0; i < records; i++ )
+	{
+		int isA = i < iface->num4;
+
+		// The first answer of an announcement starts with the name we just
+		// wrote, all the rest refer back to it at offset 12.
+		if( is_probe || i > 0 )
+		{
+			*(obptr++) = 0xc0; *(obptr++) = 0x0c;
+		}
+		*(obptr++) = 0x00; *(obptr++) = isA ? 0x01 : 0x1c;
+		*(obptr++) = is_probe ? 0x00 : 0x80; *(obptr++) = 0x01; // Flush cache, except in probes.
+		obptr = WriteTTL( obptr, ( kind == MDNS_BUILD_GOODBYE ) ? 0 : resp->ttl );
+		if( isA )
+		{
+			*(obptr++) = 0x00; *(obptr++) = 0x04;
+			memcpy( obptr, &iface->addr4[i], 4 );
+			obptr += 4;
+		}
+#ifndef DISABLE_IPV6
+		else
+		{
+			*(obptr++) = 0x00; *(obptr++) = 0x10;
+			memcpy( obptr, &iface->addr6[i - iface->num4], 16 );
+			obptr += 16;
+		}
+#endif
+	}
+
+	return obptr - out;
+}
+
+// A record from a probe for our name, for the tie-break.
+struct probe_record
+{
+	uint16_t class;
+	uint16_t type;
+	uint16_t rdlen;
+	const uint8_t * rdata;
+};
+
+#define MAX_PROBE_RECORDS ( 2 * MAX_MDNS_IFACE_ADDRS + 8 )
+
+// RFC6762 Section 8.2, by class, then type, then the data as unsigned bytes.
+static int CompareProbeRecords( const struct probe_record * a, const struct probe_record * b )
+{
+	if( a->class != b->class ) return a->class - b->class;
+	if( a->type != b->type ) return a->type - b->type;
+	int c = memcmp( a->rdata, b->rdata, ( a->rdlen < b->rdlen ) ? a->rdlen : b->rdlen );
+	return c ? c : a->rdlen - b->rdlen;
+}
+
+static void SortProbeRecords( struct probe_record * recs, int count )
+{
+	int i, j;
+	for( i = 1; i < count; i++ )
+	{
+		for( j = i; j > 0 && CompareProbeRecords( &recs[j-1], &recs[j] ) > 0; j-- )
+		{
+			struct probe_record t = recs[j];
+			recs[j] = recs[j-1];
+			recs[j-1] = t;
+		}
+	}
+}
+
+// Another host is probing for our name at the same time.  Each side's
+// records are sorted, and compared in turn, and the first that differs
+// decides, the later data wins.  If all of them are the same, whoever has
+// more records left wins, and if neither does, it's our own probe.
+static int ProbeTiebreak( const struct mdns_responder * resp, const struct mdns_iface * iface,
+	struct probe_record * theirs, int num_theirs )
+{
+	struct probe_record ours[2*MAX_MDNS_IFACE_ADDRS];
+	int num_ours = 0;
+	int i;
+
+	for( i = 0; iface && i < iface->num4; i++ )
+		ours[num_ours++] = (struct probe_record){ 1, 1, 4, (const uint8_t*)&iface->addr4[i] };
+#ifndef DISABLE_IPV6
+	for( i = 0; iface && !resp->is_ipv4_only && i < iface->num6; i++ )
+		ours[num_ours++] = (struct probe_record){ 1, 28, 16, iface->addr6[i].s6_addr };
+#endif
+
+	SortProbeRecords( ours, num_ours );
+	SortProbeRecords( theirs, num_theirs );
+	for( i = 0; i < num_ours && i < num_theirs; i++ )
+	{
+		int c = CompareProbeRecords( &ours[i], &theirs[i] );
+		if( c ) return ( c < 0 ) ? MDNS_CONFLICT_PROBE : MDNS_CONFLICT_NONE;
+	}
+	return ( num_ours < num_theirs ) ? MDNS_CONFLICT_PROBE : MDNS_CONFLICT_NONE;
+}
+
+int MDNSIsConflict( const struct mdns_responder * resp, const struct mdns_iface * iface,
+	uint8_t * in, int inlen )
+{
+	char path[MAX_MDNS_PATH];
+	struct probe_record theirs[MAX_PROBE_RECORDS];
+	int num_theirs = 0;
+	int i;
+
+	if( inlen < 12 ) return MDNS_CONFLICT_NONE;
+
+	uint16_t * psr = (uint16_t*)in;
+	int is_response = ntohs( psr[1] ) & 0x8000;
+	int questions = ntohs( psr[2] );
+	int answers = ntohs( psr[3] );
+	int authority = ntohs( psr[4] );
+	int records = answers + authority + ntohs( psr[5] );
+	uint8_t * dataptr = in + 12;
+	uint8_t * dataend = in + inlen;
+
+	for( i = 0; i < questions; i++ )
+	{
+		dataptr = MDNSReadName( in, dataptr, dataend, path );
+		if( !dataptr || dataend - dataptr < 4 ) return MDNS_CONFLICT_NONE;
+		dataptr += 4;
+	}
+
+	for( i = 0; i < records; i++ )
+	{
+		dataptr = MDNSReadName( in, dataptr, dataend, path );
+		if( !dataptr || dataend - dataptr < 10 ) return MDNS_CONFLICT_NONE;
+
+		int type = ( dataptr[0] << 8 ) | dataptr[1];
+		int class = ( ( dataptr[2] << 8 ) | dataptr[3] ) & 0x7fff; // Without the cache flush bit.
+		uint32_t ttl = ( dataptr[4] << 24 ) | ( dataptr[5] << 16 ) | ( dataptr[6] << 8 ) | dataptr[7];
+		int rdlen = ( dataptr[8] << 8 ) | dataptr[9];
+		dataptr += 10;
+		if( dataend - dataptr < rdlen ) return MDNS_CONFLICT_NONE;
+
+		if( !IsOurName( resp, path ) )
+		{
+			// Not about us.
+		}
+		else if( is_response )
+		{
+			// Goodbyes (TTL 0) aren't claims on the name, and neither are
+			// other responders on this host, answering with its other addresses.
+			if( ttl && ( ( type == 1 && rdlen == 4 ) || ( type == 28 && rdlen == 16 ) ) &&
+				!IsOurAddress( resp, type, dataptr ) && !IsHostAddress( resp, type, dataptr ) )
+			{
+				return MDNS_CONFLICT_NAME;
+			}
+		}
+		else if( i >= answers && i < answers + authority && num_theirs < MAX_PROBE_RECORDS )
+		{
+			// A probe has the records it wants to claim as authority (RFC6762 8.2).
+			theirs[num_theirs++] = (struct probe_record){ class, type, rdlen, dataptr };
+		}
+		dataptr += rdlen;
+	}
+
+	if( is_response || !num_theirs ) return MDNS_CONFLICT_NONE;
+	return ProbeTiebreak( resp, iface, theirs, num_theirs );
+}
+
+#ifdef MDNS_LOOKUPS
+int MDNSBuildForwardQuery( uint8_t * query, int querylen, uint8_t * out, int outmax )
+{
+	char path[MAX_MDNS_PATH];
+	int qtype;
+	uint8_t * qend = ParseQuestion( query, querylen, path, &qtype );
+	if( !qend ) return 0;
+
+	int both = ( qtype == 1 || qtype == 28 );
+	int qlen = qend - query - 12;
+	if( outmax < 12 + qlen * 2 ) return 0;
+
+	uint16_t * obb = (uint16_t*)out;
+	*(obb++) = ((uint16_t*)query)[0]; // Responders echo the ID back to legacy unicast queries.
+	*(obb++) = 0;
+	*(obb++) = htons( both ? 2 : 1 );
+	*(obb++) = 0;
+	*(obb++) = 0;
+	*(obb++) = 0;
+
+	uint8_t * obptr = out + 12;
+	memcpy( obptr, query + 12, qlen - 4 );
+	obptr += qlen - 4;
+	*(obptr++) = qtype >> 8; *(obptr++) = qtype;
+	*(obptr++) = 0x00; *(obptr++) = 0x01;
+
+	// The name is written out again rather than compressed, since not every
+	// responder (this one included) follows pointers in questions.
+	if( both )
+	{
+		memcpy( obptr, query + 12, qlen - 4 );
+		obptr += qlen - 4;
+		*(obptr++) = 0x00; *(obptr++) = ( qtype == 1 ) ? 28 : 1;
+		*(obptr++) = 0x00; *(obptr++) = 0x01;
+	}
+
+	return obptr - out;
+}
+
+// Finds the records of an MDNS response.  Returns a pointer past the
+// questions, or 0 if this isn't a response.
+static uint8_t * FindRecords( uint8_t * in, int inlen, int * records )
+{
+	char path[MAX_MDNS_PATH];
+	int i;
+
+	if( inlen < 12 ) return 0;
+
+	uint16_t * psr = (uint16_t*)in;
+	if( !( ntohs( psr[1] ) & 0x8000 ) ) return 0;
+
+	int questions = ntohs( psr[2] );
+	*records = ntohs( psr[3] ) + ntohs( psr[4] ) + ntohs( psr[5] );
+	uint8_t * dataptr = in + 12;
+	uint8_t * dataend = in + inlen;
+
+	for( i = 0; i < questions; i++ )
+	{
+		dataptr = MDNSReadName( in, dataptr, dataend, path );
+		if( !dataptr || dataend - dataptr < 4 ) return 0;
+		dataptr += 4;
+	}
+	return dataptr;
+}
+
+// Reads one record into rec.  Returns a pointer past it, or 0 if the packet
+// ends early.  *usable is 0 for OPT, anything but class IN, and anything
+// that doesn't fit in rec.
+static uint8_t * ReadRecord( uint8_t * in, uint8_t * dataptr, uint8_t * dataend,
+	struct mdns_record * rec, int * usable, int * flush )
+{
+	char target[MAX_MDNS_PATH];
+
+	dataptr = MDNSReadName( in, dataptr, dataend, rec->name );
+	if( !dataptr || dataend - dataptr < 10 ) return 0;
+
+	int type = ( dataptr[0] << 8 ) | dataptr[1];
+	int class = ( ( dataptr[2] << 8 ) | dataptr[3] ) & 0x7fff; // Without the cache flush bit.
+	*flush = dataptr[2] & 0x80;
+	rec->ttl = ( dataptr[4] << 24 ) | ( dataptr[5] << 16 ) | ( dataptr[6] << 8 ) | dataptr[7];
+	int rdlen = ( dataptr[8] << 8 ) | dataptr[9];
+	uint8_t * rd = dataptr + 10;
+	if( dataend - rd < rdlen ) return 0;
+	dataptr = rd + rdlen;
+
+	rec->type = type;
+	rec->rdlen = 0;
+	*usable = 0;
+	if( class != 1 || type == 41 ) return dataptr;
+
+	// Names inside the data may be compressed against this packet, so they
+	// have to be written back out in full.
+	int prefix = ( type == 33 /*SRV*/ ) ? 6 : ( type == 2 || type == 5 || type == 12 ) ? 0 : -1;
+	if( prefix >= 0 )
+	{
+		if( rdlen < prefix || !MDNSReadName( in, rd + prefix, dataptr, target ) ) return dataptr;
+		memcpy( rec->rdata, rd, prefix );
+		uint8_t * e = WriteDottedName( rec->rdata + prefix, rec->rdata + MAX_MDNS_RDATA, target );
+		if( !e ) return dataptr;
+		rec->rdlen = e - rec->rdata;
+	}
+	else
+	{
+		if( rdlen > MAX_MDNS_RDATA ) return dataptr;
+		memcpy( rec->rdata, rd, rdlen );
+		rec->rdlen = rdlen;
+	}
+	*usable = 1;
+	return dataptr;
+}
+
+static int FindRecord( const struct mdns_answers * set, const struct mdns_record * rec )
+{
+	int j;
+	for( j = 0; j < set->count; j++ )
+	{
+		const struct mdns_record * o = &set->records[j];
+		if( o->type == rec->type && o->rdlen == rec->rdlen && strcmp( o->name, rec->name ) == 0 &&
+			memcmp( o->rdata, rec->rdata, rec->rdlen ) == 0 )
+			return j;
+	}
+	return -1;
+}
+
+int MDNSCollectRecords( uint8_t * in, int inlen, struct mdns_answers * set )
+{
+	struct mdns_record rec;
+	int i, records, usable, flush, added = 0;
+	uint8_t * dataend = in + inlen;
+	uint8_t * dataptr = FindRecords( in, inlen, &records );
+
+	for( i = 0; dataptr && i < records; i++ )
+	{
+		dataptr = ReadRecord( in, dataptr, dataend, &rec, &usable, &flush );
+
+		// Goodbyes are not answers.
+		if( !dataptr || !usable || rec.ttl == 0 ) continue;
+
+		// The same record from another responder, or another interface.
+		int j = FindRecord( set, &rec );
+		if( j >= 0 )
+		{
+			if( rec.ttl > set->records[j].ttl ) set->records[j].ttl = rec.ttl;
+			continue;
+		}
+		if( set->count >= set->max ) continue;
+
+		set->records[set->count++] = rec;
+		added++;
+	}
+
+	return added;
+}
+
+int MDNSCacheRecords( uint8_t * in, int inlen, struct mdns_answers * cache, uint32_t now )
+{
+	struct mdns_record rec;
+	int i, j, records, usable, flush, changed = 0;
+	uint8_t * dataend = in + inlen;
+	uint8_t * dataptr = FindRecords( in, inlen, &records );
+
+	for( i = 0; dataptr && i < records; i++ )
+	{
+		dataptr = ReadRecord( in, dataptr, dataend, &rec, &usable, &flush );
+		if( !dataptr || !usable ) continue;
+
+		j = FindRecord( cache, &rec );
+
+		// RFC6762 Section 10.1, a goodbye means forget it.
+		if( rec.ttl == 0 )
+		{
+			if( j >= 0 ) cache->records[j] = cache->records[--cache->count];
+			changed++;
+			continue;
+		}
+
+		// RFC6762 Section 10.2, the cache flush bit means this is the whole
+		// set, so anything else of that name and type from before now is stale.
+		for( j = 0; flush && j < cache->count; j++ )
+		{
+			struct mdns_record * o = &cache->records[j];
+			if( o->type == rec.type && o->expires - o->ttl < now && strcmp( o->name, rec.name ) == 0 )
+			{
+				*o = cache->records[--cache->count];
+				j--;
+			}
+		}
+
+		rec.expires = now + rec.ttl;
+		j = FindRecord( cache, &rec );
+		if( j < 0 && cache->count < cache->max )
+			j = cache->count++;
+		else if( j < 0 )
+		{
+			// Full up, make room by dropping whatever would have expired first.
+			int k;
+			for( j = 0, k = 1; k < cache->count; k++ )
+				if( cache->records[k].expires < cache->records[j].expires ) j = k;
+		}
+		cache->records[j] = rec;
+		changed++;
+	}
+
+	return changed;
+}
+
+int MDNSCacheLookup( const struct mdns_answers * cache, uint8_t * query, int querylen,
+	uint32_t now, struct mdns_answers * found )
+{
+	char path[MAX_MDNS_PATH];
+	int qtype, i;
+
+	found->count = 0;
+	if( !ParseQuestion( query, querylen, path, &qtype ) ) return MDNS_ANSWER_NONE;
+
+	for( i = 0; i < cache->count && found->count < found->max; i++ )
+	{
+		const struct mdns_record * rec = &cache->records[i];
+		if( rec->expires <= now || strcmp( rec->name, path ) != 0 ) continue;
+		struct mdns_record * o = &found->records[found->count++];
+		*o = *rec;
+		o->ttl = rec->expires - now;
+	}
+
+	// A and AAAA are asked for together, so if we have either, we heard
+	// from the host, and it just doesn't have the other.
+	int status = MDNSAnswerStatus( query, querylen, found );
+	for( i = 0; status == MDNS_ANSWER_NODATA && ( qtype == 1 || qtype == 28 ) && i < found->count; i++ )
+	{
+		if( found->records[i].type == 1 || found->records[i].type == 28 )
+			status = MDNS_ANSWER_FOUND;
+	}
+	return status;
+}
+
+static int PrefixMatch( const uint8_t * a, const uint8_t * b, int bits )
+{
+	int bytes = bits / 8;
+	if( memcmp( a, b, bytes ) != 0 ) return 0;
+	if( !( bits & 7 ) ) return 1;
+	uint8_t mask = 0xff00 >> ( bits & 7 );
+	return ( ( a[bytes] ^ b[bytes] ) & mask ) == 0;
+}
+
+// DNS can't say which interface a link-local IPv6 address is on, and
+// clients put them, and loopback, first (RFC6724), then fail to connect().
+// Our own loopback address is no use to anyone asking over the network.
+static int IsUsableAddress( const struct mdns_record * rec )
+{
+	if( rec->type == 1 && rec->rdlen == 4 ) return rec->rdata[0] != 127;
+#ifndef DISABLE_IPV6
+	if( rec->type == 28 && rec->rdlen == 16 )
+	{
+		const struct in6_addr * a = (const struct in6_addr*)rec->rdata;
+		return !IN6_IS_ADDR_LINKLOCAL( a ) && !IN6_IS_ADDR_LOOPBACK( a ) && !IN6_IS_ADDR_V4MAPPED( a );
+	}
+#endif
+	return 1;
+}
+
+// Lower is better.  Link-local is last, since a client can't use it
+// without knowing which interface it's on.
+static int AddressRank( const struct mdns_responder * resp, const struct mdns_record * rec )
+{
+	int i, j;
+	if( rec->type == 1 && rec->rdlen == 4 )
+	{
+		if( rec->rdata[0] == 169 && rec->rdata[1] == 254 ) return 2;
+		for( i = 0; i < resp->num_ifaces; i++ )
+			for( j = 0; j < resp->ifaces[i].num4; j++ )
+				if( resp->ifaces[i].plen4[j] && PrefixMatch( rec->rdata, (const uint8_t*)&resp->ifaces[i].addr4[j], resp->ifaces[i].plen4[j] ) )
+					return 0;
+		return 1;
+	}
+#ifndef DISABLE_IPV6
+	if( rec->type == 28 && rec->rdlen == 16 )
+	{
+		if( IN6_IS_ADDR_LINKLOCAL( (const struct in6_addr*)rec->rdata ) ) return 2;
+		for( i = 0; i < resp->num_ifaces; i++ )
+			for( j = 0; j < resp->ifaces[i].num6; j++ )
+				if( resp->ifaces[i].plen6[j] && PrefixMatch( rec->rdata, resp->ifaces[i].addr6[j].s6_addr, resp->ifaces[i].plen6[j] ) )
+					return 0;
+		return 1;
+	}
+#endif
+	return 0;
+}
+
+void MDNSRankAnswers( const struct mdns_responder * resp, struct mdns_answers * set )
+{
+	int i, j;
+	if( set->count < 2 ) return;
+
+	int rank[set->count];
+
+	for( i = 0; i < set->count; i++ )
+		rank[i] = AddressRank( resp, &set->records[i] );
+
+	// Insertion sort, so records of the same rank stay in the order they came.
+	for( i = 1; i < set->count; i++ )
+	{
+		for( j = i; j > 0 && rank[j-1] > rank[j]; j-- )
+		{
+			struct mdns_record tr = set->records[j];
+			int t = rank[j];
+			set->records[j] = set->records[j-1];
+			rank[j] = rank[j-1];
+			set->records[j-1] = tr;
+			rank[j-1] = t;
+		}
+	}
+}
+
+int MDNSAnswerStatus( uint8_t * query, int querylen, const struct mdns_answers * set )
+{
+	char path[MAX_MDNS_PATH];
+	int qtype, i;
+	int status = MDNS_ANSWER_NONE;
+
+	if( !ParseQuestion( query, querylen, path, &qtype ) ) return MDNS_ANSWER_NONE;
+
+	for( i = 0; i < set->count; i++ )
+	{
+		if( IsAnswerFor( &set->records[i], path, qtype ) ) return MDNS_ANSWER_FOUND;
+		if( strcmp( set->records[i].name, path ) == 0 ) status = MDNS_ANSWER_NODATA;
+	}
+	return status;
+}
+
+// Finds the client's EDNS0 OPT record (RFC6891), if it sent one, and returns
+// how big a UDP response it will take.  Without one, that's 512 (RFC1035).
+static int ClientPayloadSize( uint8_t * query, int querylen, uint8_t * qend, int * has_opt )
+{
+	char path[MAX_MDNS_PATH];
+	uint16_t * psr = (uint16_t*)query;
+	int records = ntohs( psr[3] ) + ntohs( psr[4] ) + ntohs( psr[5] );
+	uint8_t * dataptr = qend;
+	uint8_t * dataend = query + querylen;
+	int i;
+
+	*has_opt = 0;
+	for( i = 0; i < records; i++ )
+	{
+		dataptr = MDNSReadName( query, dataptr, dataend, path );
+		if( !dataptr || dataend - dataptr < 10 ) break;
+		int type = ( dataptr[0] << 8 ) | dataptr[1];
+		int rdlen = ( dataptr[8] << 8 ) | dataptr[9];
+		if( type == 41 /*OPT*/ )
+		{
+			// The class of an OPT record is the payload size.
+			int size = ( dataptr[2] << 8 ) | dataptr[3];
+			*has_opt = 1;
+			return size < 512 ? 512 : size;
+		}
+		dataptr += 10 + rdlen;
+		if( dataptr > dataend ) break;
+	}
+	return 512;
+}
+
+int MDNSBuildDNSResponse( uint8_t * query, int querylen, const struct mdns_answers * set,
+	int rcode, int is_stream, uint8_t * out, int outmax )
+{
+	char path[MAX_MDNS_PATH];
+	int qtype, i, pass, has_opt;
+	int counts[2] = { 0, 0 };
+	int truncated = 0;
+	uint8_t * qend = ParseQuestion( query, querylen, path, &qtype );
+	if( !qend ) return 0;
+
+	// Over UDP, only as much as the client said it can take.  Leave room to
+	// tell it how much we can take, too.
+	int payload = ClientPayloadSize( query, querylen, qend, &has_opt );
+	if( !is_stream && outmax > payload ) outmax = payload;
+	if( has_opt ) outmax -= 11;
+
+	int qlen = qend - query - 12;
+	if( outmax < 12 + qlen ) return 0;
+
+	uint16_t qflags = ntohs( ((uint16_t*)query)[1] );
+	uint16_t * obb = (uint16_t*)out;
+	*(obb++) = ((uint16_t*)query)[0];
+	obb++; // Flags, once we know if it fit.
+	*(obb++) = htons( 1 );
+
+	uint8_t * obptr = out + 12;
+	uint8_t * obend = out + outmax;
+	memcpy( obptr, query + 12, qlen );
+	obptr += qlen;
+
+	// First the answers, then everything else we heard (i.e. the other
+	// address family) as additional records.
+	for( pass = 0; pass < 2 && !truncated; pass++ )
+	{
+		for( i = 0; i < set->count; i++ )
+		{
+			const struct mdns_record * rec = &set->records[i];
+			if( IsAnswerFor( rec, path, qtype ) != ( pass == 0 ) || !IsUsableAddress( rec ) ) continue;
+
+			uint8_t * recstart = obptr;
+			if( strcmp( rec->name, path ) == 0 && obend - obptr >= 2 )
+			{
+				*(obptr++) = 0xc0; *(obptr++) = 0x0c;
+			}
+			else
+			{
+				obptr = WriteDottedName( obptr, obend, rec->name );
+			}
+
+			if( !obptr || obend - obptr < 10 + rec->rdlen )
+			{
+				// Missing answers mean the client should ask again over TCP,
+				// missing additional records do not (RFC2181 Section 9).
+				obptr = recstart;
+				truncated = ( pass == 0 );
+				break;
+			}
+
+			// RFC6762 Section 6.7, legacy unicast answers shouldn't be cached long.
+			uint32_t ttl = rec->ttl > 10 ? 10 : rec->ttl;
+			*(obptr++) = rec->type >> 8; *(obptr++) = rec->type;
+			*(obptr++) = 0x00; *(obptr++) = 0x01;
+			obptr = WriteTTL( obptr, ttl );
+			*(obptr++) = rec->rdlen >> 8; *(obptr++) = rec->rdlen;
+			memcpy( obptr, rec->rdata, rec->rdlen );
+			obptr += rec->rdlen;
+			counts[pass]++;
+		}
+	}
+
+	if( has_opt )
+	{
+		// Root name, OPT, our payload size, no extended rcode or flags, no options.
+		*(obptr++) = 0;
+		*(obptr++) = 0x00; *(obptr++) = 41;
+		*(obptr++) = RESOLVER_EDNS_PAYLOAD >> 8; *(obptr++) = RESOLVER_EDNS_PAYLOAD & 0xff;
+		obptr = WriteTTL( obptr, 0 );
+		*(obptr++) = 0; *(obptr++) = 0;
+		counts[1]++;
+	}
+
+	// Response, TC if answers were left out, copy RD, RA
+	((uint16_t*)out)[1] = htons( 0x8000 | ( truncated ? 0x0200 : 0 ) | ( qflags & 0x0100 ) | 0x0080 | rcode );
+	*(obb++) = htons( counts[0] );
+	*(obb++) = 0;
+	*(obb++) = htons( counts[1] );
+	return obptr - out;
+}
+#endif
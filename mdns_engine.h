@@ -0,0 +1,213 @@
+//
+// MIT License
+//
+// Copyright 2024 <>< Charles Lohr
+//
+// Packet engine for minimdnsd.  See LICENSE for full text.
+//
+// This is the parse / match / respond core of the server, with no sockets
+// in it.  A packet goes in, and maybe a reply comes out, along with what the
+// caller should do with it.  It is built as libminimdnsd.a so it can be
+// linked into the daemon, replayed against captures and profiled offline.
+//
+
+#ifndef _MDNS_ENGINE_H
+#define _MDNS_ENGINE_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <netinet/in.h>
+
+// Features can be compiled out, see the profiles in the Makefile.
+//#define DISABLE_IPV6
+//#define DISABLE_RESOLVER // -r
+//#define DISABLE_NSS      // -s
+//#define DISABLE_NETNS    // -n and -N
+//#define DISABLE_TRACE    // -T
+//#define DISABLE_CONFIG   // -c and SIGHUP
+
+// The resolver and the NSS module both look names up on the network, and in
+// the cache of what peers have said.
+#if !defined( DISABLE_RESOLVER ) || !defined( DISABLE_NSS )
+#define MDNS_LOOKUPS
+#endif
+
+// Long enough for hostname.local, and for a full ip6.arpa reverse name.
+#define MAX_MDNS_PATH (HOST_NAME_MAX+16)
+#define MDNS_PORT 5353
+
+// RFC6762 Section 6.1
+#define MDNS_MAX_PACKET 9036
+
+// Where the daemon takes lookups from the NSS module, with -s.  Over it go
+// DNS queries and responses, with a 2 byte length in front, as over TCP.
+#ifndef MINIMDNSD_SOCKET
+#define MINIMDNSD_SOCKET "/run/minimdnsd.sock"
+#endif
+
+// How long peers may cache our records, in seconds.
+#define MDNS_DEFAULT_TTL 240
+
+#define MAX_MDNS_IFACES 16
+#define MAX_MDNS_IFACE_ADDRS 4
+#define MAX_MDNS_HOST_ADDRS 32
+
+// Our local addresses on one interface, as announced, and as answered with.
+struct mdns_iface
+{
+	int ifindex;
+	int num4;
+	struct in_addr addr4[MAX_MDNS_IFACE_ADDRS];
+	uint8_t plen4[MAX_MDNS_IFACE_ADDRS]; // Prefix length, or 0 if not known.
+#ifndef DISABLE_IPV6
+	int num6;
+	struct in6_addr addr6[MAX_MDNS_IFACE_ADDRS];
+	uint8_t plen6[MAX_MDNS_IFACE_ADDRS];
+#endif
+};
+
+// What we answer to.
+struct mdns_responder
+{
+	char hostname[HOST_NAME_MAX+1];
+	int  hostnamelen;
+	int  is_ipv4_only;
+	uint32_t ttl;
+	int  num_ifaces;
+	struct mdns_iface ifaces[MAX_MDNS_IFACES];
+
+	// The rest of the host's addresses, i.e. global ones, which we don't
+	// answer with, but another responder on this host (avahi,
+	// systemd-resolved) may answer for our name with.  IPv4 is v4-mapped.
+	int  num_host_addrs;
+	struct in6_addr host_addrs[MAX_MDNS_HOST_ADDRS];
+};
+
+// Where a packet came in, as learned from IP_PKTINFO / IPV6_PKTINFO.
+struct mdns_rxinfo
+{
+	int rxinterface;
+	int is_resolver;
+	int is_stream; // Resolver query over TCP, so no UDP size limit.
+	int ipv4_valid;
+	struct in_addr local_addr_4;
+#ifndef DISABLE_IPV6
+	int ipv6_valid;
+	struct in6_addr local_addr_6;
+#endif
+};
+
+// For the resolver, records gathered from MDNS responses, or from our own
+// tables, to answer a plain DNS client with.  The caller provides storage.
+#define MAX_MDNS_RDATA 256
+
+// The UDP payload size we advertise to EDNS0 resolver clients.
+#define RESOLVER_EDNS_PAYLOAD 4096
+
+struct mdns_record
+{
+	char name[MAX_MDNS_PATH];
+	uint16_t type;
+	uint16_t rdlen;
+	uint32_t ttl;
+	uint32_t expires; // In the cache, when to forget it, in seconds.
+	uint8_t rdata[MAX_MDNS_RDATA]; // With any names in it uncompressed.
+};
+
+struct mdns_answers
+{
+	int count;
+	int max;
+	struct mdns_record * records;
+};
+
+// How far along a forwarded query is, from MDNSAnswerStatus
+#define MDNS_ANSWER_NONE   0 // Nobody has said anything about the name.
+#define MDNS_ANSWER_NODATA 1 // The name exists, but not with the type asked for.
+#define MDNS_ANSWER_FOUND  2
+
+// Return values from MDNSProcessPacket
+#define MDNS_ACTION_NONE    0 // Nothing to send.
+#define MDNS_ACTION_REPLY   1 // Send out to the sender, and to the multicast group.
+#define MDNS_ACTION_UNICAST 2 // Send out to the sender only.
+#define MDNS_ACTION_FORWARD 3 // Resolver should repeat the query onto the network.
+
+// Kinds of unsolicited packets for MDNSBuildRecords
+#define MDNS_BUILD_PROBE    0 // Query for our name, with our records as authority (RFC6762 8.1)
+#define MDNS_BUILD_ANNOUNCE 1 // Unsolicited response with all our records (RFC6762 8.3)
+#define MDNS_BUILD_GOODBYE  2 // Announcement with a TTL of 0, so peers drop us (RFC6762 10.1)
+
+// Return values from MDNSIsConflict
+#define MDNS_CONFLICT_NONE  0
+#define MDNS_CONFLICT_NAME  1 // Another host has our name, pick a new one (RFC6762 9)
+#define MDNS_CONFLICT_PROBE 2 // Another host is probing for it too, and won the tie-break (RFC6762 8.2)
+
+uint8_t * ParseMDNSPath( uint8_t * dat, uint8_t * dataend, char * topop, int * len );
+
+// Like ParseMDNSPath, but follows compression pointers, which responses use.
+uint8_t * MDNSReadName( uint8_t * pkt, uint8_t * dat, uint8_t * dataend, char * topop );
+
+// Addresses we join, announce and answer reverse lookups for.
+int IsAddressLocal( const struct in_addr * testaddr );
+#ifndef DISABLE_IPV6
+int IsAddress6Local( const struct in6_addr * addr );
+#endif
+
+const struct mdns_iface * MDNSFindIface( const struct mdns_responder * resp, int ifindex );
+
+// in may be modified.  out must be at least MDNS_MAX_PACKET bytes.
+int MDNSProcessPacket( const struct mdns_responder * resp, const struct mdns_rxinfo * rx,
+	uint8_t * in, int inlen, uint8_t * out, int * outlen );
+
+#ifdef MDNS_LOOKUPS
+// Turns a resolver client's query into the MDNS query to forward.  A and AAAA
+// queries ask for both, so a dual-stack lookup only takes one round trip.
+// The question, twice, is all that's in it, so out need only be
+// MDNS_FORWARD_QUERY_MAX bytes.
+#define MDNS_FORWARD_QUERY_MAX ( 12 + 2 * ( MAX_MDNS_PATH + 5 ) )
+int MDNSBuildForwardQuery( uint8_t * query, int querylen, uint8_t * out, int outmax );
+
+// Adds the records from an MDNS response to set, merging duplicates.
+// Returns how many new records there were.
+int MDNSCollectRecords( uint8_t * in, int inlen, struct mdns_answers * set );
+
+// Passive cache, of everything peers announce and answer (RFC6762 Section 10),
+// so lookups for hosts we've heard from don't have to go to the network.
+// now is any monotonic count of seconds.  Returns how many records changed.
+int MDNSCacheRecords( uint8_t * in, int inlen, struct mdns_answers * cache, uint32_t now );
+
+// Copies what the cache has on the name asked about to found, with the time
+// it has left as the TTL.  Returns the MDNSAnswerStatus of that, except that
+// for A or AAAA, an address of either family counts as found.
+int MDNSCacheLookup( const struct mdns_answers * cache, uint8_t * query, int querylen,
+	uint32_t now, struct mdns_answers * found );
+
+// Sorts addresses the client can most likely reach first: those on one of
+// our subnets, then other addresses, then link-local.  Otherwise keeps order.
+void MDNSRankAnswers( const struct mdns_responder * resp, struct mdns_answers * set );
+
+int MDNSAnswerStatus( uint8_t * query, int querylen, const struct mdns_answers * set );
+
+// Builds the DNS response to query, records matching the question go in the
+// answer section, the rest in additional.  rcode is 0, 3 (NXDOMAIN), etc.
+// Loopback and link-local IPv6 addresses are left out, the client can't use them.
+// Unless is_stream, the response is kept to what the client can take over
+// UDP (512, or its EDNS0 size), with TC set if answers had to be left out.
+int MDNSBuildDNSResponse( uint8_t * query, int querylen, const struct mdns_answers * set,
+	int rcode, int is_stream, uint8_t * out, int outmax );
+#endif
+
+// Builds a probe, announcement or goodbye with all the addresses on one interface.
+// Returns the length, or 0 if there is nothing to send.
+int MDNSBuildRecords( const struct mdns_responder * resp, const struct mdns_iface * iface,
+	int kind, uint8_t * out, int outmax );
+
+// While probing, checks a packet that came in on iface for anyone else
+// wanting our name.  A response claiming it with an address that isn't one
+// of the host's is MDNS_CONFLICT_NAME.  A probe for it with records that
+// sort after those we probe iface with is MDNS_CONFLICT_PROBE, the same
+// records are our own probe looped back.
+int MDNSIsConflict( const struct mdns_responder * resp, const struct mdns_iface * iface,
+	uint8_t * in, int inlen );
+
+#endif
@@ -0,0 +1,311 @@
+//
+// MIT License
+//
+// Copyright 2024 <>< Charles Lohr
+//
+// Per-packet latency tracing for minimdnsd.  See LICENSE for full text.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <sys/mman.h>
+#include "mdns_trace.h"
+
+#ifndef DISABLE_TRACE
+
+#define MAX_TRACE_SOCKS 4
+
+int trace_enabled;
+
+// Single producer ring.  Slots are filled in and then published by moving
+// head, so a reader only needs to look at head to know what is valid.
+// Only allocated when tracing, so it costs nothing otherwise.  It's shared,
+// not private, so forwarders we fork can still write to their record.
+static struct trace_record * ring;
+static _Atomic uint32_t ring_head;
+
+// With SOF_TIMESTAMPING_OPT_ID, the kernel numbers every send that asked for
+// a timestamp, per socket.  We keep the same count to match them back up.
+static struct
+{
+	int sock;
+	uint32_t next_key;
+} trace_socks[MAX_TRACE_SOCKS];
+static int num_trace_socks;
+
+static int FindTraceSock( int sock )
+{
+	int i;
+	for( i = 0; i < num_trace_socks; i++ )
+		if( trace_socks[i].sock == sock ) return i;
+	return -1;
+}
+
+int TraceEnable( int sock )
+{
+	// Receive timestamps for everything, but transmit timestamps only for
+	// sends that ask for them with a control message in TraceSendTo.  That
+	// way forked resolver children sending on the same socket don't throw
+	// off the OPT_ID count.
+	int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+		SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+
+	if( FindTraceSock( sock ) >= 0 ) return 0;
+
+	if( !ring )
+	{
+		ring = mmap( 0, TRACE_RING_SIZE * sizeof( struct trace_record ), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+		if( ring == MAP_FAILED ) ring = 0;
+	}
+
+	if( !ring || num_trace_socks >= MAX_TRACE_SOCKS ||
+		setsockopt( sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof( flags ) ) != 0 )
+	{
+		fprintf( stderr, "WARNING: Could not enable SO_TIMESTAMPING (%d %s)\n", errno, strerror( errno ) );
+		return -1;
+	}
+
+	trace_socks[num_trace_socks].sock = sock;
+	trace_socks[num_trace_socks].next_key = 0;
+	num_trace_socks++;
+	trace_enabled = 1;
+	return 0;
+}
+
+void TraceDisable( int sock )
+{
+	int i = FindTraceSock( sock );
+	if( i < 0 ) return;
+	trace_socks[i] = trace_socks[--num_trace_socks];
+
+	// The fd number may be used again, with the OPT_ID count starting over,
+	// so old records must not pick up the new socket's timestamps.
+	for( i = 0; i < TRACE_RING_SIZE; i++ )
+	{
+		if( ring[i].sock == sock )
+			ring[i].has_tx = 0;
+	}
+}
+
+int64_t TraceNow( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_REALTIME, &ts );
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+struct trace_record * TraceBeginConn( int sock )
+{
+	if( !trace_enabled ) return 0;
+	uint32_t head = atomic_load_explicit( &ring_head, memory_order_relaxed );
+	struct trace_record * rec = &ring[head & ( TRACE_RING_SIZE - 1 )];
+	memset( rec, 0, sizeof( *rec ) );
+	rec->sock = sock;
+	rec->seq = head;
+	rec->start_ns = TraceNow();
+	return rec;
+}
+
+struct trace_record * TraceBegin( int sock )
+{
+	// Other namespaces' sockets aren't timestamped, so would only give half a record.
+	if( !trace_enabled || FindTraceSock( sock ) < 0 ) return 0;
+	return TraceBeginConn( sock );
+}
+
+void TraceCommit( struct trace_record * rec )
+{
+	if( !rec ) return;
+	atomic_fetch_add_explicit( &ring_head, 1, memory_order_release );
+}
+
+void TraceLateSent( struct trace_record * rec, uint32_t seq )
+{
+	if( rec && rec->seq == seq )
+		rec->sent_ns = TraceNow();
+}
+
+void TraceRxCmsg( struct trace_record * rec, struct cmsghdr * cmsg )
+{
+	if( rec && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING )
+	{
+		struct scm_timestamping * ts = (struct scm_timestamping *)CMSG_DATA( cmsg );
+		rec->rx_ns = ts->ts[0].tv_sec * 1000000000LL + ts->ts[0].tv_nsec;
+	}
+}
+
+int TraceSendTo( struct trace_record * rec, int sock, const void * buf, int len,
+	const struct sockaddr * to, socklen_t tolen )
+{
+	int i = rec ? FindTraceSock( sock ) : -1;
+	if( i >= 0 )
+	{
+		struct iovec iov = { .iov_base = (void*)buf, .iov_len = len };
+		uint8_t cmbuf[CMSG_SPACE( sizeof( uint32_t ) )] = { 0 };
+		struct msghdr msghdr = {
+			.msg_name = (void*)to,
+			.msg_namelen = tolen,
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = cmbuf,
+			.msg_controllen = sizeof( cmbuf ),
+		};
+		struct cmsghdr * cmsg = CMSG_FIRSTHDR( &msghdr );
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SO_TIMESTAMPING;
+		cmsg->cmsg_len = CMSG_LEN( sizeof( uint32_t ) );
+		*(uint32_t*)CMSG_DATA( cmsg ) = SOF_TIMESTAMPING_TX_SOFTWARE;
+
+		int r = sendmsg( sock, &msghdr, MSG_NOSIGNAL );
+		if( r >= 0 )
+		{
+			rec->tx_key = trace_socks[i].next_key++;
+			rec->has_tx = 1;
+		}
+		return r;
+	}
+	return sendto( sock, buf, len, MSG_NOSIGNAL, to, tolen );
+}
+
+static void TraceMatchTx( int sock, uint32_t key, int64_t tx_ns )
+{
+	uint32_t head = atomic_load_explicit( &ring_head, memory_order_acquire );
+	int i;
+
+	// Replies go out right away, so the record is almost always one of the
+	// last few.  Include the slot being filled in right now, too.
+	for( i = 0; i <= 64 && i <= head; i++ )
+	{
+		struct trace_record * rec = &ring[( head - i ) & ( TRACE_RING_SIZE - 1 )];
+		if( rec->sock == sock && rec->has_tx && rec->tx_key == key )
+		{
+			rec->tx_ns = tx_ns;
+			return;
+		}
+	}
+}
+
+int TraceDrainErrQueue( int sock )
+{
+	int count = 0;
+
+	for( ;; )
+	{
+		uint8_t data[64];
+		uint8_t cmbuf[512];
+		struct iovec iov = { .iov_base = data, .iov_len = sizeof( data ) };
+		struct msghdr msghdr = {
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = cmbuf,
+			.msg_controllen = sizeof( cmbuf ),
+		};
+
+		if( recvmsg( sock, &msghdr, MSG_ERRQUEUE | MSG_DONTWAIT ) < 0 )
+			break;
+
+		int64_t tx_ns = 0;
+		int has_key = 0;
+		uint32_t key = 0;
+
+		for ( struct cmsghdr *cmsg = CMSG_FIRSTHDR( &msghdr );
+			cmsg != NULL;
+			cmsg = CMSG_NXTHDR( &msghdr, cmsg ) )
+		{
+			if( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING )
+			{
+				struct scm_timestamping * ts = (struct scm_timestamping *)CMSG_DATA( cmsg );
+				tx_ns = ts->ts[0].tv_sec * 1000000000LL + ts->ts[0].tv_nsec;
+			}
+			else if( ( cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVERR ) ||
+				( cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_RECVERR ) )
+			{
+				struct sock_extended_err * ee = (struct sock_extended_err *)CMSG_DATA( cmsg );
+				if( ee->ee_errno == ENOMSG && ee->ee_origin == SO_EE_ORIGIN_TIMESTAMPING )
+				{
+					key = ee->ee_data;
+					has_key = 1;
+				}
+			}
+		}
+
+		if( has_key && tx_ns )
+		{
+			TraceMatchTx( sock, key, tx_ns );
+			count++;
+		}
+	}
+
+	return count;
+}
+
+// Not inlined, so its path buffer isn't on the stack under every packet.
+__attribute__((noinline)) int TraceDump( const char * path )
+{
+	if( !ring ) return -1;
+
+	char tmppath[PATH_MAX];
+	snprintf( tmppath, sizeof( tmppath ), "%s.tmp", path );
+
+	FILE * f = fopen( tmppath, "w" );
+	if( !f )
+	{
+		fprintf( stderr, "WARNING: Could not write trace to %s (%d %s)\n", tmppath, errno, strerror( errno ) );
+		return -1;
+	}
+
+	int pathlen = strlen( path );
+	int is_json = pathlen > 5 && strcmp( path + pathlen - 5, ".json" ) == 0;
+
+	uint32_t head = atomic_load_explicit( &ring_head, memory_order_acquire );
+	uint32_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+	uint32_t i;
+
+	if( is_json )
+		fprintf( f, "[\n" );
+	else
+		fprintf( f, "rx_ns,queue_ns,process_ns,send_ns,tx_ns,socket,action,len\n" );
+
+	for( i = first; i != head; i++ )
+	{
+		struct trace_record * rec = &ring[i & ( TRACE_RING_SIZE - 1 )];
+
+		// Queue delay is from the kernel receiving the packet until we got
+		// around to it.  Send time is until the kernel put the reply on the
+		// wire if we know it, else until sendto returned.
+		long long queue_ns = rec->rx_ns ? rec->start_ns - rec->rx_ns : -1;
+		long long process_ns = rec->process_ns - rec->start_ns;
+		long long send_ns = ( rec->tx_ns ? rec->tx_ns : rec->sent_ns ) - rec->process_ns;
+		if( !rec->sent_ns ) send_ns = -1;
+
+		if( is_json )
+			fprintf( f, "%s{\"rx_ns\":%lld,\"queue_ns\":%lld,\"process_ns\":%lld,\"send_ns\":%lld,\"tx_ns\":%lld,\"socket\":%d,\"action\":%d,\"len\":%d}\n",
+				( i == first ) ? "" : ",", (long long)rec->rx_ns, queue_ns, process_ns, send_ns, (long long)rec->tx_ns, rec->sock, rec->action, rec->len );
+		else
+			fprintf( f, "%lld,%lld,%lld,%lld,%lld,%d,%d,%d\n",
+				(long long)rec->rx_ns, queue_ns, process_ns, send_ns, (long long)rec->tx_ns, rec->sock, rec->action, rec->len );
+	}
+
+	if( is_json )
+		fprintf( f, "]\n" );
+
+	if( fclose( f ) != 0 || rename( tmppath, path ) != 0 )
+	{
+		fprintf( stderr, "WARNING: Could not write trace to %s (%d %s)\n", path, errno, strerror( errno ) );
+		return -1;
+	}
+
+	printf( "Wrote %d trace records to %s\n", (int)( head - first ), path );
+	fflush( stdout );
+	return 0;
+}
+#endif
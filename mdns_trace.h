@@ -0,0 +1,97 @@
+//
+// MIT License
+//
+// Copyright 2024 <>< Charles Lohr
+//
+// Per-packet latency tracing for minimdnsd.  See LICENSE for full text.
+//
+// With -T, the MDNS and resolver sockets get SO_TIMESTAMPING so the kernel
+// tells us when each query arrived and when each unicast reply actually left.
+// Along with timestamps taken in HandleRX, one record per query we answer or
+// forward goes into a ring buffer, which is written out as CSV (or JSON, if
+// the file name ends in .json) on SIGUSR1.  Queries over TCP and the NSS
+// socket only have our own timestamps.  The ring is shared with forked
+// forwarders, so they can fill in when their reply went out.
+//
+
+#ifndef _MDNS_TRACE_H
+#define _MDNS_TRACE_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define TRACE_RING_SIZE 4096 // Must be a power of two.
+
+// All times are CLOCK_REALTIME ns, to match the kernel's software timestamps.
+struct trace_record
+{
+	int64_t rx_ns;      // Kernel received the query.
+	int64_t start_ns;   // HandleRX picked it up.
+	int64_t process_ns; // Packet engine finished.
+	int64_t sent_ns;    // sendto()s returned, or 0 if the reply hasn't gone yet.
+	int64_t tx_ns;      // Kernel transmitted the unicast reply, or 0.
+	uint32_t tx_key;    // SOF_TIMESTAMPING_OPT_ID of the unicast reply.
+	uint32_t seq;       // Which time round the ring this slot was used.
+	int16_t sock;
+	int16_t action;
+	int16_t len;
+	int16_t has_tx;
+};
+
+#ifndef DISABLE_TRACE
+extern int trace_enabled;
+
+int TraceEnable( int sock );
+
+// Call before closing a socket TraceEnable was called for.
+void TraceDisable( int sock );
+
+int64_t TraceNow( void );
+
+// Returns a slot to fill in, or 0 if tracing is off, or sock isn't traced.
+struct trace_record * TraceBegin( int sock );
+
+// Same, for TCP and NSS connections, which have no kernel timestamps.
+struct trace_record * TraceBeginConn( int sock );
+
+// Only committed records are kept, so leave out anything not worth a record.
+void TraceCommit( struct trace_record * rec );
+
+// For replies that go out after the record is committed, from a forwarder,
+// or once a lookup has heard from the network.  seq is rec->seq from before
+// then, in case the ring has come round to that slot since.
+void TraceLateSent( struct trace_record * rec, uint32_t seq );
+
+// Picks the kernel receive timestamp out of a recvmsg control message.
+void TraceRxCmsg( struct trace_record * rec, struct cmsghdr * cmsg );
+
+// Like sendto, but requests a transmit timestamp for rec, if tracing.
+int TraceSendTo( struct trace_record * rec, int sock, const void * buf, int len,
+	const struct sockaddr * to, socklen_t tolen );
+
+// Reads transmit timestamps off the socket error queue.  Returns how many
+// were read, so the caller can tell these apart from real socket faults.
+int TraceDrainErrQueue( int sock );
+
+int TraceDump( const char * path );
+#else
+// Compiled out, so callers don't need to be.
+#define trace_enabled 0
+static inline int TraceEnable( int sock ) { return -1; }
+static inline void TraceDisable( int sock ) { }
+static inline int64_t TraceNow( void ) { return 0; }
+static inline struct trace_record * TraceBegin( int sock ) { return 0; }
+static inline struct trace_record * TraceBeginConn( int sock ) { return 0; }
+static inline void TraceCommit( struct trace_record * rec ) { }
+static inline void TraceLateSent( struct trace_record * rec, uint32_t seq ) { }
+static inline void TraceRxCmsg( struct trace_record * rec, struct cmsghdr * cmsg ) { }
+static inline int TraceSendTo( struct trace_record * rec, int sock, const void * buf, int len,
+	const struct sockaddr * to, socklen_t tolen )
+{
+	return sendto( sock, buf, len, MSG_NOSIGNAL, to, tolen );
+}
+static inline int TraceDrainErrQueue( int sock ) { return 0; }
+static inline int TraceDump( const char * path ) { return -1; }
+#endif
+
+#endif
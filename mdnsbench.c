@@ -0,0 +1,491 @@
+//
+// MIT License
+//
+// Copyright 2024 <>< Charles Lohr
+//
+// Load generator for minimdnsd.  See LICENSE for full text.
+//
+// This fires a configurable mix of queries at a running minimdnsd over
+// loopback multicast (and optionally at the -r resolver) and reports
+// throughput, reply latency and what the daemon cost in CPU and RAM.
+//
+// Usage: mdnsbench -n hostname [-p daemon_pid] [-d seconds] [-w window]
+//                  [-m match=60,miss=20,multi=10,aaaa=5,resolver=5]
+//
+// Query kinds:
+//  * match    - A query for hostname.local (expects a reply)
+//  * miss     - A query for a name nobody has (no reply)
+//  * multi    - Two questions, a miss and then a match (expects a reply)
+//  * aaaa     - AAAA query for hostname.local to [::1]:53 (expects a reply)
+//  * resolver - A query for hostname.local to 127.0.0.67:53 (expects a reply)
+//
+// aaaa and resolver need the daemon to be running with -r.  A query that
+// expects a reply and gets none in a second is counted as lost.
+//
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
+
+#define MDNS_PORT 5353
+#define RESOLVER_PORT 53
+#define RESOLVER_IP "127.0.0.67"
+#define RESOLVER_IP6 "::1"
+#define MAX_SAMPLES (1<<20)
+#define REPLY_TIMEOUT_NS 1000000000LL
+
+enum
+{
+	KIND_MATCH,
+	KIND_MISS,
+	KIND_MULTI,
+	KIND_AAAA,
+	KIND_RESOLVER,
+	KIND_COUNT,
+};
+
+static const char * kind_names[KIND_COUNT] = { "match", "miss", "multi", "aaaa", "resolver" };
+static const int kind_expects_reply[KIND_COUNT] = { 1, 0, 1, 1, 1 };
+static int kind_weight[KIND_COUNT] = { 60, 20, 10, 5, 5 };
+
+static const char * hostname;
+
+// Outstanding queries are indexed by transaction ID.
+static int64_t outstanding[65536];
+static int outstanding_kind[65536];
+static int in_flight;
+
+static uint32_t * samples;
+static int nsamples;
+
+static int64_t sent[KIND_COUNT];
+static int64_t answered[KIND_COUNT];
+static int64_t lost[KIND_COUNT];
+static int64_t unmatched;
+
+static int64_t NowNS( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint8_t * AppendName( uint8_t * p, const char * name, const char * domain )
+{
+	const char * parts[2] = { name, domain };
+	int i;
+	for( i = 0; i < 2; i++ )
+	{
+		const char * s = parts[i];
+		while( *s )
+		{
+			const char * e = s;
+			while( *e && *e != '.' ) e++;
+			*(p++) = e - s;
+			memcpy( p, s, e - s );
+			p += e - s;
+			s = *e ? e + 1 : e;
+		}
+	}
+	*(p++) = 0;
+	return p;
+}
+
+static uint8_t * AppendQuestion( uint8_t * p, const char * name, int type )
+{
+	p = AppendName( p, name, "local" );
+	*(p++) = 0; *(p++) = type;
+	*(p++) = 0; *(p++) = 1;
+	return p;
+}
+
+static int BuildQuery( uint8_t * buffer, int kind, uint16_t id )
+{
+	uint16_t * hdr = (uint16_t*)buffer;
+	uint8_t * p = buffer + 12;
+	int questions = 1;
+
+	switch( kind )
+	{
+	case KIND_MATCH:
+	case KIND_RESOLVER:
+		p = AppendQuestion( p, hostname, 1 );
+		break;
+	case KIND_MISS:
+		p = AppendQuestion( p, "mdnsbench-nobody-home", 1 );
+		break;
+	case KIND_MULTI:
+		p = AppendQuestion( p, "mdnsbench-nobody-home", 1 );
+		p = AppendQuestion( p, hostname, 1 );
+		questions = 2;
+		break;
+	case KIND_AAAA:
+		p = AppendQuestion( p, hostname, 28 );
+		break;
+	}
+
+	hdr[0] = htons( id );
+	hdr[1] = 0;
+	hdr[2] = htons( questions );
+	hdr[3] = 0;
+	hdr[4] = 0;
+	hdr[5] = 0;
+	return p - buffer;
+}
+
+static int PickKind( void )
+{
+	int total = 0, i;
+	for( i = 0; i < KIND_COUNT; i++ ) total += kind_weight[i];
+	int r = rand() % total;
+	for( i = 0; i < KIND_COUNT; i++ )
+	{
+		if( r < kind_weight[i] ) return i;
+		r -= kind_weight[i];
+	}
+	return KIND_MATCH;
+}
+
+static int ParseMix( char * mix )
+{
+	int i;
+	for( i = 0; i < KIND_COUNT; i++ ) kind_weight[i] = 0;
+
+	char * tok = strtok( mix, "," );
+	while( tok )
+	{
+		char * eq = strchr( tok, '=' );
+		if( !eq ) return -1;
+		*eq = 0;
+		for( i = 0; i < KIND_COUNT; i++ )
+		{
+			if( strcmp( tok, kind_names[i] ) == 0 ) break;
+		}
+		if( i == KIND_COUNT ) return -1;
+		kind_weight[i] = atoi( eq + 1 );
+		tok = strtok( 0, "," );
+	}
+
+	int total = 0;
+	for( i = 0; i < KIND_COUNT; i++ ) total += kind_weight[i];
+	return total > 0 ? 0 : -1;
+}
+
+// Returns user+system CPU time of pid in clock ticks, or -1.
+static long long ReadProcCPU( int pid )
+{
+	char path[64];
+	char buf[1024];
+	snprintf( path, sizeof( path ), "/proc/%d/stat", pid );
+	FILE * f = fopen( path, "r" );
+	if( !f ) return -1;
+	int r = fread( buf, 1, sizeof( buf ) - 1, f );
+	fclose( f );
+	if( r <= 0 ) return -1;
+	buf[r] = 0;
+
+	// The command name may contain spaces, so start after the closing paren.
+	char * p = strrchr( buf, ')' );
+	if( !p ) return -1;
+	unsigned long long utime, stime;
+	if( sscanf( p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime ) != 2 )
+		return -1;
+	return utime + stime;
+}
+
+static long ReadProcStatusKB( int pid, const char * field )
+{
+	char path[64];
+	char line[256];
+	long ret = -1;
+	int flen = strlen( field );
+	snprintf( path, sizeof( path ), "/proc/%d/status", pid );
+	FILE * f = fopen( path, "r" );
+	if( !f ) return -1;
+	while( fgets( line, sizeof( line ), f ) )
+	{
+		if( strncmp( line, field, flen ) == 0 && line[flen] == ':' )
+		{
+			ret = atol( line + flen + 1 );
+			break;
+		}
+	}
+	fclose( f );
+	return ret;
+}
+
+static int CompareU32( const void * a, const void * b )
+{
+	uint32_t ua = *(const uint32_t*)a;
+	uint32_t ub = *(const uint32_t*)b;
+	return ( ua > ub ) - ( ua < ub );
+}
+
+static void HandleReply( int sock )
+{
+	uint8_t buffer[9036];
+	int r;
+	while( ( r = recv( sock, buffer, sizeof( buffer ), MSG_DONTWAIT ) ) > 0 )
+	{
+		if( r < 12 ) continue;
+		uint16_t id = ntohs( ((uint16_t*)buffer)[0] );
+		if( !outstanding[id] )
+		{
+			unmatched++;
+			continue;
+		}
+
+		int64_t dt = NowNS() - outstanding[id];
+		if( nsamples < MAX_SAMPLES )
+			samples[nsamples++] = dt > UINT32_MAX ? UINT32_MAX : dt;
+		answered[outstanding_kind[id]]++;
+		outstanding[id] = 0;
+		in_flight--;
+	}
+}
+
+static void ExpireOutstanding( int64_t now )
+{
+	int i;
+	for( i = 0; i < 65536; i++ )
+	{
+		if( outstanding[i] && now - outstanding[i] > REPLY_TIMEOUT_NS )
+		{
+			lost[outstanding_kind[i]]++;
+			outstanding[i] = 0;
+			in_flight--;
+		}
+	}
+}
+
+int main( int argc, char *argv[] )
+{
+	int c;
+	int pid = 0;
+	int duration = 5;
+	int window = 32;
+
+	while ( ( c = getopt( argc, argv, "n:p:d:w:m:" ) ) != -1 )
+	{
+		switch( c )
+		{
+		case 'n':
+			hostname = optarg;
+			break;
+		case 'p':
+			pid = atoi( optarg );
+			break;
+		case 'd':
+			duration = atoi( optarg );
+			break;
+		case 'w':
+			window = atoi( optarg );
+			break;
+		case 'm':
+			if( ParseMix( optarg ) )
+			{
+				fprintf( stderr, "Error: Bad mix, expected e.g. match=60,miss=20,multi=10,aaaa=5,resolver=5\n" );
+				return -5;
+			}
+			break;
+		default:
+		case '?':
+			fprintf( stderr, "Error: Usage: mdnsbench -n hostname [-p daemon_pid] [-d seconds] [-w window] [-m mix]\n" );
+			return -5;
+		}
+	}
+
+	if( !hostname || duration <= 0 || window <= 0 || window > 1024 )
+	{
+		fprintf( stderr, "Error: Usage: mdnsbench -n hostname [-p daemon_pid] [-d seconds] [-w window] [-m mix]\n" );
+		return -5;
+	}
+
+	samples = malloc( sizeof( uint32_t ) * MAX_SAMPLES );
+
+	int mcast = socket( AF_INET, SOCK_DGRAM, 0 );
+	int resolv = socket( AF_INET, SOCK_DGRAM, 0 );
+	int resolv6 = socket( AF_INET6, SOCK_DGRAM, 0 );
+	if( mcast < 0 || resolv < 0 || ( resolv6 < 0 && kind_weight[KIND_AAAA] ) || !samples )
+	{
+		fprintf( stderr, "FATAL: Could not create sockets\n" );
+		return -5;
+	}
+
+	struct in_addr lo = { htonl( INADDR_LOOPBACK ) };
+	int loop = 1;
+	if( setsockopt( mcast, IPPROTO_IP, IP_MULTICAST_IF, &lo, sizeof( lo ) ) != 0 ||
+		setsockopt( mcast, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof( loop ) ) != 0 )
+	{
+		fprintf( stderr, "FATAL: Could not select loopback for multicast (%d %s)\n", errno, strerror( errno ) );
+		return -5;
+	}
+
+	struct sockaddr_in sin_multicast = {
+		.sin_family = AF_INET,
+		.sin_addr = { inet_addr( "224.0.0.251" ) },
+		.sin_port = htons( MDNS_PORT )
+	};
+	struct sockaddr_in sin_resolver = {
+		.sin_family = AF_INET,
+		.sin_addr = { inet_addr( RESOLVER_IP ) },
+		.sin_port = htons( RESOLVER_PORT )
+	};
+	struct sockaddr_in6 sin6_resolver = {
+		.sin6_family = AF_INET6,
+		.sin6_port = htons( RESOLVER_PORT )
+	};
+	inet_pton( AF_INET6, RESOLVER_IP6, &sin6_resolver.sin6_addr );
+
+	long long cpu_start = pid ? ReadProcCPU( pid ) : -1;
+	int64_t start = NowNS();
+	int64_t end = start + duration * 1000000000LL;
+	int64_t last_expire = start;
+	uint16_t next_id = 1;
+
+	srand( start );
+
+	for( ;; )
+	{
+		int64_t now = NowNS();
+		if( now >= end ) break;
+
+		while( in_flight < window )
+		{
+			uint8_t buffer[512];
+			int kind = PickKind();
+			int expects = kind_expects_reply[kind];
+			uint16_t id = 0;
+
+			if( expects )
+			{
+				do
+				{
+					id = next_id++;
+				} while( !id || outstanding[id] );
+			}
+
+			int len = BuildQuery( buffer, kind, id );
+			int sock = mcast;
+			struct sockaddr * to = (struct sockaddr*)&sin_multicast;
+			socklen_t tolen = sizeof( sin_multicast );
+			if( kind == KIND_RESOLVER )
+			{
+				sock = resolv;
+				to = (struct sockaddr*)&sin_resolver;
+				tolen = sizeof( sin_resolver );
+			}
+			else if( kind == KIND_AAAA )
+			{
+				sock = resolv6;
+				to = (struct sockaddr*)&sin6_resolver;
+				tolen = sizeof( sin6_resolver );
+			}
+
+			if( sendto( sock, buffer, len, MSG_NOSIGNAL, to, tolen ) != len )
+			{
+				fprintf( stderr, "FATAL: Could not send %s query (%d %s)\n", kind_names[kind], errno, strerror( errno ) );
+				return -6;
+			}
+			sent[kind]++;
+
+			if( expects )
+			{
+				outstanding[id] = NowNS();
+				outstanding_kind[id] = kind;
+				in_flight++;
+			}
+		}
+
+		struct pollfd fds[3] = {
+			{ .fd = mcast, .events = POLLIN },
+			{ .fd = resolv, .events = POLLIN },
+			{ .fd = resolv6, .events = POLLIN },
+		};
+		int r = poll( fds, 3, 10 );
+		if( r < 0 && errno != EINTR )
+		{
+			fprintf( stderr, "FATAL: poll failed (%d %s)\n", errno, strerror( errno ) );
+			return -10;
+		}
+		if( fds[0].revents & POLLIN ) HandleReply( mcast );
+		if( fds[1].revents & POLLIN ) HandleReply( resolv );
+		if( fds[2].revents & POLLIN ) HandleReply( resolv6 );
+
+		if( now - last_expire > REPLY_TIMEOUT_NS / 4 )
+		{
+			ExpireOutstanding( now );
+			last_expire = now;
+		}
+	}
+
+	// Give stragglers a chance, then everything left is lost.
+	int64_t drain_end = NowNS() + REPLY_TIMEOUT_NS;
+	while( in_flight > 0 && NowNS() < drain_end )
+	{
+		struct pollfd fds[3] = {
+			{ .fd = mcast, .events = POLLIN },
+			{ .fd = resolv, .events = POLLIN },
+			{ .fd = resolv6, .events = POLLIN },
+		};
+		if( poll( fds, 3, 10 ) > 0 )
+		{
+			if( fds[0].revents & POLLIN ) HandleReply( mcast );
+			if( fds[1].revents & POLLIN ) HandleReply( resolv );
+			if( fds[2].revents & POLLIN ) HandleReply( resolv6 );
+		}
+	}
+	ExpireOutstanding( INT64_MAX );
+
+	double elapsed = ( NowNS() - start ) / 1e9;
+	long long cpu_end = pid ? ReadProcCPU( pid ) : -1;
+
+	int64_t total_sent = 0, total_answered = 0, total_lost = 0;
+	int i;
+	printf( "%-10s %10s %10s %10s\n", "kind", "sent", "answered", "lost" );
+	for( i = 0; i < KIND_COUNT; i++ )
+	{
+		if( !sent[i] ) continue;
+		printf( "%-10s %10lld %10lld %10lld\n", kind_names[i], (long long)sent[i], (long long)answered[i], (long long)lost[i] );
+		total_sent += sent[i];
+		total_answered += answered[i];
+		total_lost += lost[i];
+	}
+	printf( "%-10s %10lld %10lld %10lld\n", "total", (long long)total_sent, (long long)total_answered, (long long)total_lost );
+	if( unmatched )
+		printf( "Unmatched replies: %lld\n", (long long)unmatched );
+
+	printf( "Throughput: %.0f queries/s, %.0f replies/s over %.2f s\n",
+		total_sent / elapsed, total_answered / elapsed, elapsed );
+
+	if( nsamples )
+	{
+		qsort( samples, nsamples, sizeof( uint32_t ), CompareU32 );
+		printf( "Latency: p50 %.1f us, p99 %.1f us, max %.1f us\n",
+			samples[nsamples / 2] / 1000.0,
+			samples[(int)( nsamples * 0.99 )] / 1000.0,
+			samples[nsamples - 1] / 1000.0 );
+	}
+
+	if( pid )
+	{
+		if( cpu_start >= 0 && cpu_end >= 0 )
+		{
+			double cpu = ( cpu_end - cpu_start ) / (double)sysconf( _SC_CLK_TCK );
+			printf( "Daemon CPU: %.2f s (%.1f us/query)\n", cpu, total_sent ? cpu * 1e6 / total_sent : 0 );
+		}
+		printf( "Daemon RSS: %ld kB (peak %ld kB)\n", ReadProcStatusKB( pid, "VmRSS" ), ReadProcStatusKB( pid, "VmHWM" ) );
+	}
+
+	return 0;
+}
@@ -0,0 +1,498 @@
+//
+// MIT License
+//
+// Copyright 2024 <>< Charles Lohr
+//
+// pcap replay harness for the minimdnsd packet engine.  See LICENSE for full text.
+//
+// Every UDP packet to port 5353 (or 53, with -r) in a capture is fed through
+// MDNSProcessPacket, exactly as the daemon would, and the results are written
+// one line per packet, as "<packet#> <action> <hex reply>".  These are then
+// compared against a golden file (or the golden file is written with -g).
+// Each packet is also run repeatedly to report nanoseconds per packet.
+// With -r, DNS over TCP to port 53 is replayed too, one message to a segment.
+//
+// Usage: mdnsreplay [-n hostname] [-a local_address]... [-A host_address]... [-4] [-r]
+//                   [-c] [-p] [-i iterations] [-g] capture.pcap golden.txt
+//        mdnsreplay [-n hostname] [-a local_address]... [-4] -b [-g] golden.txt
+//
+// Queries that arrive on a multicast address are answered with the -a
+// addresses, like a daemon bound to an interface with that address.  The -a
+// addresses are also what reverse lookups are answered for.
+//
+// With -c, peers' responses go in a cache, as the daemon's do, by the
+// capture's timestamps, and queries the resolver would forward are answered
+// from it, as they would be once the network had had its chance.
+//
+// With -p, each packet goes through MDNSIsConflict instead, as if we were
+// probing, and the result is written instead of the action.  -A addresses
+// are elsewhere on the host, not on the interface, like those another
+// responder on the host might answer with.
+//
+// With -b, there is no capture, and the probe, announcement and goodbye for
+// the -a addresses are written instead.
+//
+
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "mdns_engine.h"
+
+#define RESOLVER_PORT 53
+
+// As many as the daemon's forwarder collects.
+#define MAX_REPLAY_RECORDS 64
+
+struct mdns_responder responder;
+
+static int is_resolver;
+static int is_conflict;
+#ifdef MDNS_LOOKUPS
+static int is_cache;
+static struct mdns_record cache_records[MAX_REPLAY_RECORDS];
+static struct mdns_answers cache = { 0, MAX_REPLAY_RECORDS, cache_records };
+#endif
+static int iterations = 1000;
+static int has_local_4;
+static struct in_addr local_4;
+#ifndef DISABLE_IPV6
+static int has_local_6;
+static struct in6_addr local_6;
+#endif
+
+static const char * action_names[] = { "none", "reply", "unicast", "forward" };
+static const char * conflict_names[] = { "none", "name", "probe" };
+static const char * build_names[] = { "probe", "announce", "goodbye" };
+
+static uint8_t in[MDNS_MAX_PACKET];
+static uint8_t out[MDNS_MAX_PACKET];
+
+static int64_t NowNS( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint32_t Read32( const uint8_t * p, int swapped )
+{
+	uint32_t v;
+	memcpy( &v, p, 4 );
+	return swapped ? __builtin_bswap32( v ) : v;
+}
+
+// Finds the UDP, or TCP, payload in a captured frame.  Returns payload
+// length, or -1 if this is not a packet for us.
+static int FindPayload( int linktype, uint8_t * frame, int len, struct mdns_rxinfo * rx, uint8_t ** payload )
+{
+	int ethertype = 0;
+	uint8_t * p = frame;
+	uint8_t * end = frame + len;
+
+	switch( linktype )
+	{
+	case 1: // Ethernet
+		if( len < 14 ) return -1;
+		ethertype = ( p[12] << 8 ) | p[13];
+		p += 14;
+		while( ethertype == 0x8100 && end - p >= 4 ) // 802.1Q
+		{
+			ethertype = ( p[2] << 8 ) | p[3];
+			p += 4;
+		}
+		break;
+	case 113: // Linux cooked
+		if( len < 16 ) return -1;
+		ethertype = ( p[14] << 8 ) | p[15];
+		p += 16;
+		break;
+	case 276: // Linux cooked v2
+		if( len < 20 ) return -1;
+		ethertype = ( p[0] << 8 ) | p[1];
+		p += 20;
+		break;
+	case 0: // BSD loopback
+		if( len < 4 ) return -1;
+		ethertype = ( p[0] == 2 || p[3] == 2 ) ? 0x0800 : 0x86dd;
+		p += 4;
+		break;
+	case 12:
+	case 101: // Raw IP
+		if( len < 1 ) return -1;
+		ethertype = ( ( p[0] >> 4 ) == 4 ) ? 0x0800 : 0x86dd;
+		break;
+	default:
+		return -1;
+	}
+
+	int proto;
+	if( ethertype == 0x0800 )
+	{
+		if( end - p < 20 ) return -1;
+		int ihl = ( p[0] & 0xf ) * 4;
+		int totlen = ( p[2] << 8 ) | p[3];
+		proto = p[9];
+		if( ( proto != 17 && proto != 6 ) || end - p < ihl + 8 || totlen > end - p ) return -1;
+		end = p + totlen;
+		struct in_addr dst;
+		memcpy( &dst, p + 16, 4 );
+		rx->ipv4_valid = 1;
+		rx->local_addr_4 = ( IN_MULTICAST( ntohl( dst.s_addr ) ) && has_local_4 ) ? local_4 : dst;
+		p += ihl;
+	}
+#ifndef DISABLE_IPV6
+	else if( ethertype == 0x86dd )
+	{
+		if( end - p < 48 ) return -1;
+		int paylen = ( p[4] << 8 ) | p[5];
+		proto = p[6];
+		if( ( proto != 17 && proto != 6 ) || paylen > end - p - 40 ) return -1;
+		end = p + 40 + paylen;
+		struct in6_addr dst;
+		memcpy( &dst, p + 24, 16 );
+		rx->ipv6_valid = 1;
+		rx->local_addr_6 = ( IN6_IS_ADDR_MULTICAST( &dst ) && has_local_6 ) ? local_6 : dst;
+		p += 40;
+	}
+#endif
+	else
+	{
+		return -1;
+	}
+
+	int dport = ( p[2] << 8 ) | p[3];
+	if( proto == 6 )
+	{
+		// Each message has its length in front.  Segments without a whole
+		// one, like the handshake, are skipped.
+		if( dport != RESOLVER_PORT || !is_resolver || end - p < 20 ) return -1;
+		int doff = ( p[12] >> 4 ) * 4;
+		if( end - p < doff + 2 ) return -1;
+		p += doff;
+		int msglen = ( p[0] << 8 ) | p[1];
+		if( msglen > end - p - 2 ) return -1;
+		rx->is_resolver = 1;
+		rx->is_stream = 1;
+		*payload = p + 2;
+		return msglen;
+	}
+
+	if( dport == RESOLVER_PORT && is_resolver )
+		rx->is_resolver = 1;
+	else if( dport != MDNS_PORT )
+		return -1;
+
+	int udplen = ( ( p[4] << 8 ) | p[5] ) - 8;
+	p += 8;
+	if( udplen < 0 || udplen > end - p ) return -1;
+	*payload = p;
+	return udplen;
+}
+
+#ifdef MDNS_LOOKUPS
+// What the daemon finally answers a forwarded query with, whatever the cache
+// has, or NXDOMAIN, like its AnswerFromCache.
+static int AnswerFromCache( uint8_t * query, int querylen, int is_stream, uint32_t now, uint8_t * out )
+{
+	static struct mdns_record found[MAX_REPLAY_RECORDS];
+	struct mdns_answers set = { 0, MAX_REPLAY_RECORDS, found };
+
+	int status = MDNSCacheLookup( &cache, query, querylen, now, &set );
+	MDNSRankAnswers( &responder, &set );
+	return MDNSBuildDNSResponse( query, querylen, &set, ( status == MDNS_ANSWER_NONE ) ? 3 /*NXDOMAIN*/ : 0,
+		is_stream, out, MDNS_MAX_PACKET );
+}
+#endif
+
+static void WriteResult( FILE * result, const uint8_t * dat, int len )
+{
+	int i;
+	for( i = 0; i < len; i++ )
+		fprintf( result, "%02x", dat[i] );
+	fprintf( result, "\n" );
+}
+
+static void BuildRecords( FILE * result )
+{
+	int kind;
+	for( kind = MDNS_BUILD_PROBE; kind <= MDNS_BUILD_GOODBYE; kind++ )
+	{
+		int len = MDNSBuildRecords( &responder, &responder.ifaces[0], kind, out, MDNS_MAX_PACKET );
+		printf( "%s: %d bytes\n", build_names[kind], len );
+		fprintf( result, "%s ", build_names[kind] );
+		WriteResult( result, out, len );
+	}
+}
+
+// Returns the capture, read up to its first packet, or 0.
+static FILE * OpenCapture( const char * capture_path, int * swapped, int * linktype )
+{
+	FILE * f = fopen( capture_path, "rb" );
+	if( !f )
+	{
+		fprintf( stderr, "Error: Can't open capture %s\n", capture_path );
+		return 0;
+	}
+
+	uint8_t gh[24];
+	if( fread( gh, 1, 24, f ) != 24 )
+	{
+		fprintf( stderr, "Error: %s is not a pcap file\n", capture_path );
+		fclose( f );
+		return 0;
+	}
+
+	uint32_t magic = Read32( gh, 0 );
+	*swapped = 0;
+	if( magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1 )
+		*swapped = 1;
+	else if( magic != 0xa1b2c3d4 && magic != 0xa1b23c4d )
+	{
+		fprintf( stderr, "Error: %s is not a pcap file (pcapng is not supported)\n", capture_path );
+		fclose( f );
+		return 0;
+	}
+	*linktype = Read32( gh + 20, *swapped ) & 0xffff;
+	return f;
+}
+
+static void ReplayCapture( FILE * f, int swapped, int linktype, FILE * result )
+{
+	static uint8_t frame[65536];
+	const char ** names = is_conflict ? conflict_names : action_names;
+	const struct mdns_iface * iface = responder.num_ifaces ? &responder.ifaces[0] : 0;
+	int packetno = 0, handled = 0;
+	int64_t total_ns = 0;
+
+	for( ;; )
+	{
+		uint8_t rh[16];
+		if( fread( rh, 1, 16, f ) != 16 ) break;
+		uint32_t caplen = Read32( rh + 8, swapped );
+		if( caplen > sizeof( frame ) || fread( frame, 1, caplen, f ) != caplen ) break;
+		uint32_t secs = Read32( rh, swapped );
+		packetno++;
+
+		struct mdns_rxinfo rx = { 0 };
+		uint8_t * payload;
+		int len = FindPayload( linktype, frame, caplen, &rx, &payload );
+		if( len < 0 || len > MDNS_MAX_PACKET ) continue;
+		handled++;
+
+		// The engine is allowed to scribble on its input, so give it a fresh copy each time.
+		int action = 0, outlen = 0, i;
+		int64_t start = NowNS();
+		for( i = 0; i < iterations; i++ )
+		{
+			memcpy( in, payload, len );
+			if( is_conflict )
+				action = MDNSIsConflict( &responder, iface, in, len );
+			else
+				action = MDNSProcessPacket( &responder, &rx, in, len, out, &outlen );
+		}
+		int64_t ns = ( NowNS() - start ) / iterations;
+		total_ns += ns;
+
+#ifdef MDNS_LOOKUPS
+		if( is_cache && action == MDNS_ACTION_FORWARD )
+		{
+			memcpy( in, payload, len );
+			outlen = AnswerFromCache( in, len, rx.is_stream, secs, out );
+		}
+		else if( is_cache && !rx.is_resolver && len >= 12 && ( payload[2] & 0x80 ) )
+		{
+			memcpy( in, payload, len );
+			MDNSCacheRecords( in, len, &cache, secs );
+		}
+#else
+		(void)secs;
+#endif
+
+		printf( "packet %d: %lld ns %s %d bytes\n", packetno, (long long)ns, names[action], outlen );
+
+		fprintf( result, "%d %s ", packetno, names[action] );
+		WriteResult( result, out, outlen );
+	}
+	fclose( f );
+
+	if( handled )
+		printf( "%d of %d packets replayed, mean %lld ns/packet\n", handled, packetno, (long long)( total_ns / handled ) );
+}
+
+static int CompareGolden( FILE * result, const char * golden_path )
+{
+	FILE * golden = fopen( golden_path, "r" );
+	if( !golden )
+	{
+		fprintf( stderr, "Error: Can't open golden file %s (use -g to create it)\n", golden_path );
+		return -1;
+	}
+
+	static char la[MDNS_MAX_PACKET*2+64];
+	static char lb[MDNS_MAX_PACKET*2+64];
+	int line = 0, mismatches = 0;
+	rewind( result );
+	for( ;; )
+	{
+		char * ra = fgets( la, sizeof( la ), result );
+		char * rb = fgets( lb, sizeof( lb ), golden );
+		line++;
+		if( !ra && !rb ) break;
+		if( !ra || !rb || strcmp( la, lb ) != 0 )
+		{
+			fprintf( stderr, "MISMATCH line %d\n  got:    %s  golden: %s", line,
+				ra ? la : "(end)\n", rb ? lb : "(end)\n" );
+			mismatches++;
+			if( !ra || !rb ) break;
+		}
+	}
+	fclose( golden );
+	return mismatches;
+}
+
+int main( int argc, char *argv[] )
+{
+	int c;
+	int generate = 0;
+	int build = 0;
+	const char * name = "minimdnsd";
+	struct mdns_iface * iface = &responder.ifaces[0];
+	iface->ifindex = 1;
+
+	while ( ( c = getopt( argc, argv, "n:a:A:4rcpbi:g" ) ) != -1 )
+	{
+		switch( c )
+		{
+		case 'n':
+			name = optarg;
+			break;
+		case 'a':
+			// Addresses all go on one pretend interface, for reverse lookups and announcements.
+			responder.num_ifaces = 1;
+			if( inet_pton( AF_INET, optarg, &local_4 ) == 1 && iface->num4 < MAX_MDNS_IFACE_ADDRS )
+			{
+				has_local_4 = 1;
+				iface->addr4[iface->num4++] = local_4;
+			}
+#ifndef DISABLE_IPV6
+			else if( inet_pton( AF_INET6, optarg, &local_6 ) == 1 && iface->num6 < MAX_MDNS_IFACE_ADDRS )
+			{
+				has_local_6 = 1;
+				iface->addr6[iface->num6++] = local_6;
+			}
+#endif
+			else
+			{
+				fprintf( stderr, "Error: Bad address %s\n", optarg );
+				return -5;
+			}
+			break;
+		case 'A':
+		{
+			struct in6_addr * host = &responder.host_addrs[responder.num_host_addrs];
+			struct in_addr addr4;
+			if( responder.num_host_addrs >= MAX_MDNS_HOST_ADDRS )
+			{
+				fprintf( stderr, "Error: Too many host addresses\n" );
+				return -5;
+			}
+			// IPv4 addresses are kept as IPv4-mapped, as the daemon does.
+			if( inet_pton( AF_INET, optarg, &addr4 ) == 1 )
+			{
+				memset( host, 0, 10 );
+				host->s6_addr[10] = host->s6_addr[11] = 0xff;
+				memcpy( &host->s6_addr[12], &addr4, 4 );
+			}
+			else if( inet_pton( AF_INET6, optarg, host ) != 1 )
+			{
+				fprintf( stderr, "Error: Bad address %s\n", optarg );
+				return -5;
+			}
+			responder.num_host_addrs++;
+			break;
+		}
+		case '4':
+			responder.is_ipv4_only = 1;
+			break;
+		case 'r':
+			is_resolver = 1;
+			break;
+#ifdef MDNS_LOOKUPS
+		case 'c':
+			is_cache = 1;
+			break;
+#endif
+		case 'p':
+			is_conflict = 1;
+			break;
+		case 'b':
+			build = 1;
+			break;
+		case 'i':
+			iterations = atoi( optarg );
+			break;
+		case 'g':
+			generate = 1;
+			break;
+		default:
+		case '?':
+			goto usage;
+		}
+	}
+
+	if( argc - optind != ( build ? 1 : 2 ) || iterations < 1 )
+		goto usage;
+
+	responder.ttl = MDNS_DEFAULT_TTL;
+	responder.hostnamelen = strlen( name );
+	if( responder.hostnamelen >= HOST_NAME_MAX ) responder.hostnamelen = HOST_NAME_MAX - 1;
+	memcpy( responder.hostname, name, responder.hostnamelen );
+
+	const char * capture_path = build ? 0 : argv[optind];
+	const char * golden_path = argv[argc-1];
+	int swapped = 0, linktype = 0;
+	FILE * f = 0;
+
+	if( !build && !( f = OpenCapture( capture_path, &swapped, &linktype ) ) )
+		return -5;
+
+	FILE * result = generate ? fopen( golden_path, "w+" ) : tmpfile();
+	if( !result )
+	{
+		fprintf( stderr, "Error: Can't open output\n" );
+		return -5;
+	}
+
+	if( build )
+		BuildRecords( result );
+	else
+		ReplayCapture( f, swapped, linktype, result );
+
+	if( generate )
+	{
+		fclose( result );
+		printf( "Wrote %s\n", golden_path );
+		return 0;
+	}
+
+	int mismatches = CompareGolden( result, golden_path );
+	fclose( result );
+	if( mismatches )
+	{
+		fprintf( stderr, "FAIL: %s does not match %s\n", build ? "records built" : capture_path, golden_path );
+		return 1;
+	}
+	printf( "PASS: %s\n", build ? golden_path : capture_path );
+	return 0;
+
+usage:
+	fprintf( stderr, "Error: Usage: mdnsreplay [-n hostname] [-a local_address]... [-A host_address]... [-4] [-r] [-c] [-p] [-i iterations] [-g] capture.pcap golden.txt\n" );
+	fprintf( stderr, "       mdnsreplay [-n hostname] [-a local_address]... [-4] -b [-g] golden.txt\n" );
+	return -5;
+}
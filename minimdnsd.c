@@ -35,8 +35,12 @@
 //  * But it does implement a fully function mnds server that advertises your
 //    host to other peers on your LAN!
 //  * Also, it's shim "dns server" that bridges DNS to MDNS.
+//  * Use of `setns` to serve several network namespaces from one process.
 //
 
+// For setns()
+#define _GNU_SOURCE
+
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -51,9 +55,11 @@
 #include <errno.h>
 #include <poll.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <linux/in6.h>
 #include <limits.h>
 #include <fcntl.h>
+#include <time.h>
 
 // For detecting interfaces going away or coming back.
 #include <linux/netlink.h>
@@ -62,15 +68,47 @@
 // For detecting "hostname" change.
 #include <sys/inotify.h>
 
+// For serving other network namespaces, and noticing them come and go.
+#include <sched.h>
+#include <dirent.h>
+
 // For DNS -> MDNS forwarding we use fork/wait
 #include <sys/wait.h>
 
-//#define DISABLE_IPV6
+// For goodbyes on SIGTERM, and the -T latency trace, dumped on SIGUSR1
+#include <signal.h>
+
+// The parse / match / respond core lives in libminimdnsd.a
+#include "mdns_engine.h"
+#include "mdns_trace.h"
 
-#define MAX_MDNS_PATH (HOST_NAME_MAX+8)
-#define MDNS_PORT 5353
 #define RESOLVER_PORT 53
 #define RESOLVER_IP "127.0.0.67"
+#define RESOLVER_IP6 "::1"
+
+// How long forwarded queries wait for the network, and how much longer once
+// the name has been heard, for the rest of the answers to come in.
+#define RESOLVER_TIMEOUT_MS 3000
+#define RESOLVER_GRACE_MS 100
+#define MAX_RESOLVER_RECORDS 64
+
+// DNS over TCP (RFC7766), for answers too big for the client over UDP.
+// Each message has a 2 byte length in front, and clients may send several
+// queries before reading any answers.
+#define MAX_RESOLVER_CONNS 16
+#define RESOLVER_TCP_IDLE_MS 10000
+#define RESOLVER_TCP_MAX_QUERY 512
+#define RESOLVER_TCP_SEND_TIMEOUT_MS 2000
+
+// The NSS module's connections, with one lookup each, have a pool of their
+// own after the TCP ones, so neither can crowd out the other.
+#define MAX_NSS_CONNS 8
+#define MAX_CONNS ( MAX_RESOLVER_CONNS + MAX_NSS_CONNS )
+
+// Records heard from peers, for the resolver and NSS lookups to answer from,
+// and how many of them go in one answer, which is on the stack.
+#define MAX_CACHE_RECORDS 64
+#define MAX_LOOKUP_RECORDS 12
 
 # if __BYTE_ORDER == __BIG_ENDIAN
 #define MDNS_BRD_ADDR ((in_addr_t) 0xe00000fb)  // 224.0.0.251
@@ -78,20 +116,51 @@
 #define MDNS_BRD_ADDR ((in_addr_t) 0xfb0000e0)  // 224.0.0.251
 #endif
 
-const char * hostname_override;
-char         hostname[HOST_NAME_MAX+1];
-int          hostnamelen = 0;
-int          hostname_watch;
-
 struct in_addr localInterface;
 struct sockaddr_in groupSock;
 
-int sdsock;
-int is_ipv4_only;
-int is_bound_6;
-int sdifaceupdown;
-int resolver;
+int resolver = -1;
+int resolver6 = -1;
+int resolver_tcp = -1;
+int resolver6_tcp = -1;
+int nss_listener = -1;
 int resolver_listener;
+int resolver_children; // Until they are all waited for, even if -r is turned off.
+
+const char * trace_path;
+volatile sig_atomic_t trace_dump_requested;
+
+#ifdef MDNS_LOOKUPS
+// Only allocated while a client is connected.  Connections from the NSS
+// module (is_local) are answered in the main loop, from the cache, with at
+// most one lookup waiting on the network at a time.
+struct resolver_conn
+{
+	int sock;
+	int len;
+	int is_local;
+	int pending;       // The query at the front of buf is waiting on the network.
+	int heard;         // And we have heard something about it.
+	int64_t deadline;
+	int64_t last_active;
+	struct trace_record * trec; // Of the pending query, with -T.
+	uint32_t trec_seq;
+	uint8_t buf[2+RESOLVER_TCP_MAX_QUERY];
+};
+struct resolver_conn * resolver_conns[MAX_CONNS];
+
+// Only allocated with -r or -s.
+struct mdns_answers cache;
+
+// Who a resolver reply goes back to, a UDP sender, or a TCP connection.
+struct resolver_client
+{
+	int sock;
+	int is_stream;
+	struct sockaddr_in6 sender;
+	socklen_t sl;
+};
+#endif
 
 // For multicast queries, and multicast replies.
 struct sockaddr_in sin_multicast = {
@@ -100,51 +169,161 @@ struct sockaddr_in sin_multicast = {
 	.sin_port = 0 // Will get filled in at main()
 };
 
-static void ReloadHostname( void )
+#ifndef DISABLE_IPV6
+// Multicast v6 = ff02:0:0:0:0:0:0:fb (link-local scope, RFC6762 Section 3)
+const struct in6_addr mdns_mcast6 = { { { 0xff,2,0,0,0,0,0,0,0,0,0,0,0,0,0,0xfb } } };
+#endif
+
+// RFC6762 Section 8: Probe three times, 250ms apart, and if no one else
+// claims our name, announce it twice, one second apart.
+#define PROBE_COUNT 3
+#define PROBE_INTERVAL_MS 250
+#define ANNOUNCE_COUNT 2
+#define ANNOUNCE_INTERVAL_MS 1000
+
+// With -n or -N, one process answers in several network namespaces, each
+// with its own sockets, hostname and interfaces.  The namespace we were
+// started in is always netns[0], and is the only one the resolver and NSS
+// module serve.
+#define NETNS_RUN_DIR "/run/netns"
+#ifndef DISABLE_NETNS
+#define MAX_NETNS 64
+#else
+#define MAX_NETNS 1
+#endif
+#define NETNS_RETRY_MS 500
+#define NETNS_MAX_RETRIES 10
+
+struct mdns_netns
 {
-	if( hostname_override )
-	{
-		hostnamelen = strlen( hostname_override );
-		if( hostnamelen >= HOST_NAME_MAX )
-		{
-			hostnamelen = HOST_NAME_MAX - 1;
-		}
-		memcpy( hostname, hostname_override, hostnamelen );
-		hostname[hostnamelen] = 0;
-		printf( "Using overridden name: \"%s.local\"\n", hostname );
-		return;
-	}
+	char name[NAME_MAX+1]; // Under NETNS_RUN_DIR, or "" for our own.
+	int nsfd;              // -1 unless there are other namespaces.
+	int sdsock;
+	int is_bound_6;
+	int sdifaceupdown;
+	int hostname_watch;
+	struct mdns_responder responder;
+
+	int     announce_step;  // 0 = idle, 1..PROBE_COUNT = probing, then announcing.
+	int     is_probing;     // Until our first announcement, the name isn't ours.
+	int64_t announce_next;  // CLOCK_MONOTONIC ms
+	int     conflict_count;
+};
+struct mdns_netns * netns[MAX_NETNS];
+int num_netns;
+struct mdns_netns * ns; // The one being worked on, its sockets are the ones we create.
+int current_nsfd = -1;  // Which namespace this process is in, if we've moved.
 
-	int fh = open( "/etc/hostname", O_RDONLY );
-	if( fh < 1 )
-	{
-		goto hostnamefault;
-	}
-	int rd = read( fh, hostname, HOST_NAME_MAX );
-	close( fh );
-	if( rd <= 0 )
+int netns_watch = -1;
+int64_t netns_retry;                 // When to look for namespaces that weren't ready.
+int netns_retries;
+
+int inotifyfd = -1;
+
+// What the command line, and the -c file, ask for.  All of it can be changed
+// with SIGHUP, except ipv4_only, which decides what sockets we have.
+#define MAX_CONFIG_SIZE 65536
+
+struct mdns_config
+{
+	const char * hostname; // Instead of /etc/hostname, in our own namespace.
+	uint32_t ttl;
+	int ipv4_only;
+	int resolver;
+	int nss;
+	int netns_all;
+	int num_netns;
+	const char * netns[MAX_NETNS];
+	char * text;           // The -c file, which the strings point into.
+};
+struct mdns_config config; // In effect.
+struct mdns_config args;   // The command line, which wins over the file.
+const char * config_path;
+volatile sig_atomic_t reload_requested;
+
+volatile sig_atomic_t exit_requested;
+
+// Our signals are blocked, except while waiting in ppoll, so one can't come
+// in between checking for it and going to sleep.  This is the mask to wait with.
+sigset_t poll_sigmask;
+
+// Like "ip netns exec", other namespaces get their /etc/hostname from /etc/netns.
+static void HostnamePath( const struct mdns_netns * n, char * path, int len )
+{
+	if( n->name[0] )
+		snprintf( path, len, "/etc/netns/%s/hostname", n->name );
+	else
+		snprintf( path, len, "/etc/hostname" );
+}
+
+// Reads ns's hostname file, lowercased and without the newline.  Returns the
+// length, or 0 if there isn't one.
+static int ReadHostnameFile( char * name )
+{
+	char path[PATH_MAX];
+	char buf[HOST_NAME_MAX];
+	int j, rd = -1;
+
+	HostnamePath( ns, path, sizeof( path ) );
+	int fh = open( path, O_RDONLY );
+	if( fh >= 0 )
 	{
-		goto hostnamefault;
+		rd = read( fh, buf, HOST_NAME_MAX );
+		close( fh );
 	}
 
-	hostnamelen = rd;
-
-	int j;
 	for( j = 0; j < rd; j++ )
 	{
-		char c = hostname[j];
+		char c = buf[j];
 		if( c == '\n' )                 // Truncate at newline
 		{
-			hostnamelen = j;
+			rd = j;
 		}
 		else if( c >= 'A' && c <= 'Z' ) // Convert to lowercase
 		{
-			hostname[j] = c + 'z' - 'Z';
+			buf[j] = c + 'z' - 'Z';
+		}
+	}
+	if( rd <= 0 ) return 0;
+
+	memcpy( name, buf, rd );
+	name[rd] = 0;
+	return rd;
+}
+
+static void ReloadHostname( void )
+{
+	if( config.hostname && ns == netns[0] )
+	{
+		ns->responder.hostnamelen = strlen( config.hostname );
+		if( ns->responder.hostnamelen >= HOST_NAME_MAX )
+		{
+			ns->responder.hostnamelen = HOST_NAME_MAX - 1;
+		}
+		memcpy( ns->responder.hostname, config.hostname, ns->responder.hostnamelen );
+		ns->responder.hostname[ns->responder.hostnamelen] = 0;
+		printf( "Using overridden name: \"%s.local\"\n", ns->responder.hostname );
+		return;
+	}
+
+	int rd = ReadHostnameFile( ns->responder.hostname );
+	if( !rd )
+	{
+		if( !ns->name[0] )
+		{
+			goto hostnamefault;
 		}
+		// Without one, a namespace answers to its own name.
+		rd = snprintf( ns->responder.hostname, HOST_NAME_MAX, "%s", ns->name );
+		if( rd >= HOST_NAME_MAX ) rd = HOST_NAME_MAX - 1;
 	}
-	hostname[hostnamelen] = 0;
 
-	printf( "Responding to hostname: \"%s.local\"\n", hostname );
+	ns->responder.hostnamelen = rd;
+
+	if( ns->name[0] )
+		printf( "Responding to hostname: \"%s.local\" in netns \"%s\"\n", ns->responder.hostname, ns->name );
+	else
+		printf( "Responding to hostname: \"%s.local\"\n", ns->responder.hostname );
 	fflush( stdout );
 	return;
 
@@ -153,17 +332,28 @@ hostnamefault:
 	return;
 }
 
+static void WatchHostname( void )
+{
+	char path[PATH_MAX];
+	HostnamePath( ns, path, sizeof( path ) );
+	ns->hostname_watch = inotify_add_watch( inotifyfd, path, IN_MODIFY | IN_CREATE );
+
+	// Not having one is fine for other namespaces, they're named after the namespace.
+	if( ns->hostname_watch < 0 && !ns->name[0] )
+	{
+		fprintf( stderr, "WARNING: inotify cannot watch file\n" );
+	}
+}
+
 #ifndef DISABLE_IPV6
 void AddMDNSInterface6( int interface )
 {
-	// Multicast v6 = ff01:0:0:0:0:0:0:fb
-
 	struct ipv6_mreq mreq6 = {
-		.ipv6mr_multiaddr = { { { 0xff,1,0,0,0,0,0,0,0,0,0,0,0,0,0,0xfb } } },
+		.ipv6mr_multiaddr = mdns_mcast6,
 		.ipv6mr_interface = interface,
 	};
 
-	if ( setsockopt( sdsock, IPPROTO_IPV6, IPV6_ADD_MEMBERSHIP, (char *)&mreq6, sizeof(mreq6)) == -1)
+	if ( setsockopt( ns->sdsock, IPPROTO_IPV6, IPV6_ADD_MEMBERSHIP, (char *)&mreq6, sizeof(mreq6)) == -1)
 	{
 		fprintf( stderr, "WARNING: Could not join ipv6 membership to interface %d (%d %s)\n", interface, errno, strerror(errno) );
 	}
@@ -176,31 +366,13 @@ void AddMDNSInterface4( struct in_addr * saddr )
 		.imr_multiaddr.s_addr = MDNS_BRD_ADDR,
 		.imr_interface = *saddr
 	};
-	if ( setsockopt( sdsock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char *)&mreq, sizeof(mreq)) == -1)
+	if ( setsockopt( ns->sdsock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char *)&mreq, sizeof(mreq)) == -1)
 	{
 		char * addr = inet_ntoa( *saddr );
 		fprintf( stderr, "WARNING: Could not join membership to %s / code %d (%s)\n", addr, errno, strerror(errno) );
 	}
 }
 
-int IsAddressLocal( struct in_addr * testaddr )
-{
-	uint32_t check = ntohl( testaddr->s_addr );
-	if ( ( check & 0xff000000 ) == 0x7f000000 ) return 1; // 127.x.x.x (Link Local, but still want to join)
-	if ( ( check & 0xff000000 ) == 0x0a000000 ) return 1; // 10.x.x.x
-	if ( ( check & 0xfff00000 ) == 0xac100000 ) return 1; // 172.[16-31].x.x
-	if ( ( check & 0xffff0000 ) == 0xc0a80000 ) return 1; // 192.168.x.x
-	if ( ( check & 0xffff0000 ) == 0xa9fe0000 ) return 1; // 169.254.x.x (RFC5735)
-	return 0;
-}
-
-#ifndef DISABLE_IPV6
-int IsAddress6Local( struct in6_addr * addr )
-{
-	return IN6_IS_ADDR_LINKLOCAL( addr ) || IN6_IS_ADDR_SITELOCAL( addr );
-}
-#endif
-
 int CheckAndAddMulticast( struct sockaddr * addr )
 {
 	if ( !addr )
@@ -222,7 +394,7 @@ int CheckAndAddMulticast( struct sockaddr * addr )
 		AddMDNSInterface4( &sa4->sin_addr );
 	}
 #ifndef DISABLE_IPV6
-	else if ( family == AF_INET6 && !is_ipv4_only )
+	else if ( family == AF_INET6 && !ns->responder.is_ipv4_only )
 	{
 		char addrbuff[INET6_ADDRSTRLEN+10] = { 0 }; // Actually 46 for IPv6, but let's add some buffer.
 		struct sockaddr_in6 * sa6 = (struct sockaddr_in6 *)addr;
@@ -257,18 +429,134 @@ static int HandleRequestingInterfaces( void )
 	return 0;
 }
 
-static inline void HandleNetlinkData( void )
+// Keep track of which of our addresses are on which interfaces, these are
+// what we announce, and what we check other responders against.
+static int PrefixLength( const uint8_t * mask, int len )
+{
+	int i, bits = 0;
+	for( i = 0; i < len; i++ )
+		bits += __builtin_popcount( mask[i] );
+	return bits;
+}
+
+// Returns 1 if what we announce changed.
+static int RefreshInterfaces( void )
+{
+	struct mdns_iface old[MAX_MDNS_IFACES];
+	int num_old = ns->responder.num_ifaces;
+	struct ifaddrs * ifaddr = 0;
+	if ( getifaddrs( &ifaddr ) == -1 )
+	{
+		fprintf( stderr, "Error: Could not query devices.\n" );
+		return 0;
+	}
+
+	memcpy( old, ns->responder.ifaces, num_old * sizeof( old[0] ) );
+	ns->responder.num_ifaces = 0;
+	ns->responder.num_host_addrs = 0;
+	for (struct ifaddrs *ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next)
+	{
+		struct sockaddr * addr = ifa->ifa_addr;
+		if( !addr || ( addr->sa_family != AF_INET && addr->sa_family != AF_INET6 ) ) continue;
+
+		int family = addr->sa_family;
+		int ifindex = if_nametoindex( ifa->ifa_name );
+		struct mdns_iface * iface = (struct mdns_iface *)MDNSFindIface( &ns->responder, ifindex );
+		int is_ours = ( family == AF_INET && IsAddressLocal( &((struct sockaddr_in*)addr)->sin_addr ) );
+#ifndef DISABLE_IPV6
+		is_ours |= ( family == AF_INET6 && !ns->responder.is_ipv4_only && IsAddress6Local( &((struct sockaddr_in6*)addr)->sin6_addr ) );
+#endif
+		if( is_ours && !iface && ns->responder.num_ifaces < MAX_MDNS_IFACES )
+		{
+			iface = &ns->responder.ifaces[ns->responder.num_ifaces++];
+			memset( iface, 0, sizeof( *iface ) );
+			iface->ifindex = ifindex;
+		}
+
+		// The prefix length is for ranking resolver answers, by whether they're on our subnet.
+		if( is_ours && iface && family == AF_INET && iface->num4 < MAX_MDNS_IFACE_ADDRS )
+		{
+			iface->plen4[iface->num4] = ifa->ifa_netmask ? PrefixLength( (uint8_t*)&((struct sockaddr_in*)ifa->ifa_netmask)->sin_addr, 4 ) : 0;
+			iface->addr4[iface->num4++] = ((struct sockaddr_in*)addr)->sin_addr;
+		}
+#ifndef DISABLE_IPV6
+		else if( is_ours && iface && family == AF_INET6 && iface->num6 < MAX_MDNS_IFACE_ADDRS )
+		{
+			iface->plen6[iface->num6] = ifa->ifa_netmask ? PrefixLength( ((struct sockaddr_in6*)ifa->ifa_netmask)->sin6_addr.s6_addr, 16 ) : 0;
+			iface->addr6[iface->num6++] = ((struct sockaddr_in6*)addr)->sin6_addr;
+		}
+#endif
+		// Everything else, so other responders on this host aren't taken for conflicts.
+		else if( ns->responder.num_host_addrs < MAX_MDNS_HOST_ADDRS )
+		{
+			struct in6_addr * host = &ns->responder.host_addrs[ns->responder.num_host_addrs++];
+			if( family == AF_INET )
+			{
+				memset( host, 0, 10 );
+				host->s6_addr[10] = host->s6_addr[11] = 0xff;
+				memcpy( &host->s6_addr[12], &((struct sockaddr_in*)addr)->sin_addr, 4 );
+			}
+			else
+			{
+				*host = ((struct sockaddr_in6*)addr)->sin6_addr;
+			}
+		}
+	}
+	freeifaddrs( ifaddr );
+
+	// Unused address slots are zeroed, so the tables can be compared whole.
+	return ns->responder.num_ifaces != num_old ||
+		memcmp( old, ns->responder.ifaces, num_old * sizeof( old[0] ) ) != 0;
+}
+
+static void StartAnnouncing( void );
+static void SendGoodbye( const struct mdns_iface * iface, const struct mdns_iface * gone );
+
+// Where every reply is built.  Only ever one is built and sent at a time, so
+// it can be kept off the stack, with room for the length a stream needs.
+static uint8_t replybuf[2+MDNS_MAX_PACKET];
+
+// An address went away, if it was one we announced, tell peers to forget it.
+static void HandleAddressRemoved( int family, int ifindex, void * data )
+{
+	const struct mdns_iface * iface = MDNSFindIface( &ns->responder, ifindex );
+	struct mdns_iface gone = { .ifindex = ifindex };
+	int j;
+
+	if( !iface || ns->is_probing ) return;
+
+	for( j = 0; family == AF_INET && j < iface->num4; j++ )
+	{
+		if( memcmp( &iface->addr4[j], data, 4 ) == 0 )
+			gone.addr4[gone.num4++] = iface->addr4[j];
+	}
+	int count = gone.num4;
+#ifndef DISABLE_IPV6
+	for( j = 0; family == AF_INET6 && j < iface->num6; j++ )
+	{
+		if( memcmp( &iface->addr6[j], data, 16 ) == 0 )
+			gone.addr6[gone.num6++] = iface->addr6[j];
+	}
+	count += gone.num6;
+#endif
+	if( !count ) return;
+
+	SendGoodbye( iface, &gone );
+}
+
+// Not inlined, so its buffer isn't on the stack under every packet we handle.
+static __attribute__((noinline)) void HandleNetlinkData( void )
 {
 	int len;
 	struct nlmsghdr *nlh;
 	char buffer[4096];
 	nlh = (struct nlmsghdr *)buffer;
-	while ( ( len = recv( sdifaceupdown, nlh, 4096, MSG_DONTWAIT ) ) > 0 )
+	while ( ( len = recv( ns->sdifaceupdown, nlh, 4096, MSG_DONTWAIT ) ) > 0 )
 	{
 		// technique is based around https://stackoverflow.com/a/2353441/2926815
 		while ( ( NLMSG_OK( nlh, len ) ) && ( nlh->nlmsg_type != NLMSG_DONE ) )
 		{
-			if ( nlh->nlmsg_type == RTM_NEWADDR )
+			if ( nlh->nlmsg_type == RTM_NEWADDR || nlh->nlmsg_type == RTM_DELADDR )
 			{
 				struct ifaddrmsg *ifa = (struct ifaddrmsg *) NLMSG_DATA( nlh );
 				struct rtattr *rth = IFA_RTA( ifa );
@@ -283,8 +571,13 @@ static inline void HandleNetlinkData( void )
 						if_indextoname( ifa->ifa_index, name );
 						int pld = RTA_PAYLOAD(rth);
 
+						if ( nlh->nlmsg_type == RTM_DELADDR )
+						{
+							if ( pld == 4 || pld == 16 )
+								HandleAddressRemoved( ifa->ifa_family, ifa->ifa_index, RTA_DATA(rth) );
+						}
 						// Record the index.
-						if ( ifa->ifa_family == AF_INET )
+						else if ( ifa->ifa_family == AF_INET )
 						{
 							struct sockaddr_in sai = { 0 };
 							sai.sin_family = AF_INET;
@@ -309,558 +602,1605 @@ static inline void HandleNetlinkData( void )
 			nlh = NLMSG_NEXT( nlh, len );
 		}
 	}
-}
 
-// MDNS functions from esp32xx
+	// New addresses aren't new names, so they don't need probing, but peers
+	// should hear about them.  The kernel also tells us about addresses
+	// whose lifetimes were only renewed, i.e. on every IPv6 router
+	// advertisement, and those are nothing new.
+	if( RefreshInterfaces() )
+		StartAnnouncing();
+}
 
-uint8_t * ParseMDNSPath( uint8_t * dat, uint8_t * dataend, char * topop, int * len )
+// Tricky: Make another socket to send, bound to the MDNS port, so that the
+// reply comes from 5353 and goes out on the interface the query came in on.
+static void SendMulticastReply( struct in_addr * local_addr_4, int ifindex, uint8_t * outbuff, int len )
 {
-	int l;
-	int j;
-
-	*len = 0;
-
-	while(dat != dataend)
+	int socks_to_send = socket( AF_INET, SOCK_DGRAM, 0 );
+
+	// With IP_MULTICAST_IF you can either pass in an ip_mreqn, or just the local_addr4.
+	// We tried to do the full txif for clarity / example. But, it seems to cause issues?
+	// So the ip_mreqn is only used when the address is already gone, for goodbyes.
+	struct ip_mreqn txif = { 0 };
+	txif.imr_ifindex = ifindex;
+	if( setsockopt( socks_to_send, IPPROTO_IP, IP_MULTICAST_IF,
+		local_addr_4 ? (void*)local_addr_4 : (void*)&txif,
+		local_addr_4 ? sizeof(*local_addr_4) : sizeof(txif) ) != 0 )
 	{
-		// See how long the string we should read is.
-		l = *(dat++);
-
-		// Zero-length strings indicate end-of-string.
-		if( l == 0 )
-			break;
-
-		if( *len + l >= MAX_MDNS_PATH )
-			return 0;
-
-		//If not our first time through, add a '.'
-		if( *len != 0 )
-		{
-			*(topop++) = '.';
-			(*len)++;
-		}
-
-		for( j = 0; j < l; j++ )
-		{
-			if( dat[j] >= 'A' && dat[j] <= 'Z' )
-				topop[j] = dat[j] - 'A' + 'a';
-			else
-				topop[j] = dat[j];
-		}
+		fprintf( stderr, "WARNING: Could not set IP_MULTICAST_IF for reply\n" );
+	}
 
-		// Move along in the string, if there are more strings to concatenate.
-		topop += l;
-		dat += l;
-		*len += l;
+	int optval = 1;
+	if ( setsockopt( socks_to_send, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof( optval ) ) != 0 )
+	{
+		fprintf( stderr, "WARNING: Could not set SO_REUSEPORT for reply\n" );
+	}
+	struct sockaddr_in sin = {
+		.sin_family = AF_INET,
+		.sin_addr = { INADDR_ANY },
+		.sin_port = htons( MDNS_PORT )
+	};
+	if ( bind( socks_to_send, (struct sockaddr *)&sin, sizeof(sin) ) == -1 )
+	{
+		fprintf( stderr, "WARNING: When sending reply, could not bind to IPv4 MDNS port (%d %s)\n", errno, strerror( errno ) );
 	}
+	if ( sendto( socks_to_send, outbuff, len, MSG_NOSIGNAL,
+		(struct sockaddr*)&sin_multicast, sizeof(sin_multicast) ) != len )
+	{
+		fprintf( stderr, "WARNING: Could not send multicast reply for MDNS query\n" );
+	}
+	close( socks_to_send );
+}
 
-	*topop = 0; //Null terminate.
-	return dat;
+#ifndef DISABLE_IPV6
+static void SendMulticast6( int ifindex, uint8_t * outbuff, int len )
+{
+	// For link-local multicast the scope id picks the outgoing interface.
+	struct sockaddr_in6 sin6 = {
+		.sin6_family = AF_INET6,
+		.sin6_addr = mdns_mcast6,
+		.sin6_port = htons( MDNS_PORT ),
+		.sin6_scope_id = ifindex,
+	};
+	if ( sendto( ns->sdsock, outbuff, len, MSG_NOSIGNAL, (struct sockaddr*)&sin6, sizeof(sin6) ) != len )
+	{
+		fprintf( stderr, "WARNING: Could not send IPv6 multicast on interface %d (%d %s)\n", ifindex, errno, strerror( errno ) );
+	}
 }
+#endif
 
+static int64_t NowMS( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
 
-static inline void HandleRX( int sock, int is_resolver )
+static void StartProbing( void )
 {
-	uint8_t buffer[9036]; // RFC6762 Section 6.1
-	char path[MAX_MDNS_PATH];
-	int i, stlen;
+	// Random 0-250ms delay so hosts that all come up at once don't collide.
+	ns->announce_step = 1;
+	ns->is_probing = 1;
+	ns->announce_next = NowMS() + rand() % PROBE_INTERVAL_MS;
+}
 
-	struct sockaddr_in6 sender = { 0 };
-	socklen_t sl = sizeof( sender );
+static void StartAnnouncing( void )
+{
+	if( ns->is_probing ) return;
+	ns->announce_step = PROBE_COUNT + 1;
 
-	// Using recvmsg
+	// Netlink tends to tell us about several addresses at once.
+	ns->announce_next = NowMS() + 20;
+}
 
-	// This is a little tricky - so we can avoid having a separate socket for every single
-	// interface, we can instead, just recvmsg and discern which interfaces the message
-	// came frmo.
+static int AnnounceTimeout( const struct mdns_netns * n )
+{
+	if( !n->announce_step ) return -1;
+	int64_t wait = n->announce_next - NowMS();
+	return wait > 0 ? wait : 0;
+}
 
-	// if you want access to the data you need to init the msg_iovec fields
-	struct iovec iov = {
-		.iov_base = buffer,
-		.iov_len = sizeof( buffer ),
-	};
-	uint8_t cmbuf[1024];
-	struct msghdr msghdr = {
-		.msg_name = &sender,
-		.msg_namelen = sizeof( sender ),
-		.msg_control = cmbuf,
-		.msg_controllen = sizeof( cmbuf ),
-		.msg_flags = 0,
-		.msg_iov = &iov,
-		.msg_iovlen = 1,
-	};
+static void AnnounceTick( void )
+{
+	if( !ns->announce_step || NowMS() < ns->announce_next ) return;
 
-	int r = recvmsg( sock, &msghdr, 0 );
+	int is_probe = ns->announce_step <= PROBE_COUNT;
+	int i;
+	uint8_t * outbuff = replybuf + 2;
 
-	if( r < 0 || msghdr.msg_flags & (MSG_TRUNC | MSG_CTRUNC) )
-	{
-		// This should basically never happen.
-		return;
-	}
+	RefreshInterfaces();
 
-	if( r < 12 )
+	// One packet per interface, with all of its addresses in it.
+	for( i = 0; i < ns->responder.num_ifaces; i++ )
 	{
-		// Runt packet - can't do anything with these.
-		return;
-	}
+		struct mdns_iface * iface = &ns->responder.ifaces[i];
+		int len = MDNSBuildRecords( &ns->responder, iface,
+			is_probe ? MDNS_BUILD_PROBE : MDNS_BUILD_ANNOUNCE, outbuff, MDNS_MAX_PACKET );
+		if( !len ) continue;
 
-	struct in_addr local_addr_4 = { 0 };
-	int rxinterface = 0;
-	int ipv4_valid = 0;
+		if( iface->num4 )
+			SendMulticastReply( &iface->addr4[0], 0, outbuff, len );
 #ifndef DISABLE_IPV6
-	struct in6_addr local_addr_6 = { 0 };
-	int ipv6_valid = 0;
+		if( iface->num6 && ns->is_bound_6 )
+			SendMulticast6( iface->ifindex, outbuff, len );
 #endif
+	}
 
-	for ( struct cmsghdr *cmsg = CMSG_FIRSTHDR( &msghdr );
-    		cmsg != NULL;
-    		cmsg = CMSG_NXTHDR( &msghdr, cmsg ) )
+	if( is_probe )
 	{
-		// ignore the control headers that don't match what we want
-		// see https://stackoverflow.com/a/5309155/2926815
-		if ( cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO )
+		ns->announce_next = NowMS() + PROBE_INTERVAL_MS;
+	}
+	else
+	{
+		if( ns->is_probing )
 		{
-			struct in_pktinfo * pi = (struct in_pktinfo *)CMSG_DATA(cmsg);
-			// at this point, peeraddr is the source sockaddr
-			// pi->ipi_spec_dst is the destination in_addr
-			// pi->ipi_addr is the destination address, in_addr
-			local_addr_4 = pi->ipi_spec_dst;
-			rxinterface = pi->ipi_ifindex;
-			// pi->ipi_addr is actually the multicast address.
-			ipv4_valid = 1;
+			printf( "Announcing \"%s.local\"\n", ns->responder.hostname );
+			fflush( stdout );
 		}
-#ifndef DISABLE_IPV6
-		else if( cmsg->cmsg_level == IPPROTO_IPV6 && 
-				( cmsg->cmsg_type == IPV6_PKTINFO || cmsg->cmsg_type == IPV6_RECVPKTINFO ) )
-		{
-			// Some build platforms do not include this.
-			struct in6_pktinfo_shadow
-			{
-				struct in6_addr ipi6_addr;	/* src/dst IPv6 address */
-				unsigned int ipi6_ifindex;	/* send/recv interface index */
-			};
-
-			struct in6_pktinfo_shadow * pi = (struct in6_pktinfo_shadow *)CMSG_DATA(cmsg);
+		ns->is_probing = 0;
+		ns->announce_next = NowMS() + ANNOUNCE_INTERVAL_MS;
+	}
 
-			local_addr_6 = pi->ipi6_addr;
-			ipv6_valid = 1;
-			rxinterface = pi->ipi6_ifindex;
+	if( ++ns->announce_step > PROBE_COUNT + ANNOUNCE_COUNT )
+		ns->announce_step = 0;
+}
 
-			//int i;
-			//for( i = 0; i < sizeof( local_addr_6 ); i++ )
-			//	printf( "%02x", ((uint8_t*)&local_addr_6)[i] );
-			//printf( "\n" );
-		}
-#endif
-	}
+// Says goodbye to the addresses in gone, or all of iface's if 0.  Like the
+// announcement, it goes out over both IPv4 and IPv6, whichever family the
+// addresses were.
+static void SendGoodbye( const struct mdns_iface * iface, const struct mdns_iface * gone )
+{
+	uint8_t * outbuff = replybuf + 2;
+	int len = MDNSBuildRecords( &ns->responder, gone ? gone : iface, MDNS_BUILD_GOODBYE, outbuff, MDNS_MAX_PACKET );
+	if( !len ) return;
 
-	// Tricky - if ipv4 is valid, that means the ipv6 address is not to be trusted.
-	// it's the broadcast address.
+	// If the address was just removed, we can't pick the interface by it anymore.
+	if( iface->num4 )
+		SendMulticastReply( gone ? 0 : (struct in_addr*)&iface->addr4[0], iface->ifindex, outbuff, len );
 #ifndef DISABLE_IPV6
-	if( ipv4_valid ) ipv6_valid = 0;
+	if( iface->num6 && ns->is_bound_6 )
+		SendMulticast6( iface->ifindex, outbuff, len );
 #endif
-	uint16_t * psr = (uint16_t*)buffer;
-	uint16_t xactionid = ntohs( psr[0] );
-	uint16_t flags = ntohs( psr[1] );
-	uint16_t questions = ntohs( psr[2] );
-	// We discard answers.
-	//uint16_t answers = ntohs( psr[3] );
+}
 
-	// Tricky - index 12 bytes in, we can do a direct reply.
-	uint8_t * dataptr = (uint8_t*)buffer + 12;
-	uint8_t * dataend = dataptr + r - 12;
+// Tell everyone to forget all of our records (RFC6762 Section 10.1), i.e. we
+// are going away, or our name is changing.
+static void SendGoodbyes( void )
+{
+	int i;
+	if( ns->is_probing ) return;
+	for( i = 0; i < ns->responder.num_ifaces; i++ )
+		SendGoodbye( &ns->responder.ifaces[i], 0 );
+}
 
-	// MDNS reply (we are a server, not a client, so discard).
-	if( flags & 0x8000 )
-		return;
+static void ExitSignal( int sig )
+{
+	exit_requested = 1;
+}
 
-	int is_a_suitable_mdns_record_query = 0;
+// What we go by after conflict_count conflicts, i.e. "name-2".
+static int ConflictName( char * out, const char * name, int conflict_count )
+{
+	if( !conflict_count ) return snprintf( out, HOST_NAME_MAX + 1, "%s", name );
+	return snprintf( out, HOST_NAME_MAX + 1, "%.*s-%d", HOST_NAME_MAX - 12, name, conflict_count + 1 );
+}
 
-	int found = 0;
+// Someone else probed for our name at the same time, and won the tie-break.
+// RFC6762 Section 8.2, wait a second, and probe for it again, by which time
+// they will have taken it, if they're going to.
+static void DeferProbing( void )
+{
+	fprintf( stderr, "WARNING: Another host is probing for \"%s.local\" too, probing again in a second\n", ns->responder.hostname );
+	StartProbing();
+	ns->announce_next = NowMS() + 1000;
+}
 
-	//Query
-	for( i = 0; i < questions; i++ )
-	{
-		uint8_t * namestartptr = dataptr;
-		//Work our way through.
-		dataptr = ParseMDNSPath( dataptr, dataend, path, &stlen );
+// Someone else answered for our name while we were probing for it.  Like
+// RFC6762 Section 9, pick a new name and start over.
+static void HandleNameConflict( void )
+{
+	char newname[HOST_NAME_MAX+1];
+	ns->conflict_count++;
+	ReloadHostname();
+	int len = ConflictName( newname, ns->responder.hostname, ns->conflict_count );
+	memcpy( ns->responder.hostname, newname, len + 1 );
+	ns->responder.hostnamelen = len;
+	fprintf( stderr, "WARNING: Name conflict, another host has this name.  Trying \"%s.local\"\n", ns->responder.hostname );
+
+	// After 15 conflicts, RFC6762 wants us to slow down.
+	StartProbing();
+	if( ns->conflict_count >= 15 )
+		ns->announce_next = NowMS() + 5000;
+}
 
-		// Make sure there is still room left for the rest of the record.
-		if( !dataptr || dataend - dataptr < 4 ) break;
+// The hostname file was written to.  DHCP hooks, hostnamectl and the like
+// rewrite it with the same name, and may truncate it first, so only a real
+// rename says goodbye to the old name and probes for the new one.
+static void HandleHostnameWritten( void )
+{
+	char name[HOST_NAME_MAX+1];
+	char current[HOST_NAME_MAX+1];
 
-		int pathlen = strlen( path );
+	if( !ReadHostnameFile( name ) ) return;
+	ConflictName( current, name, ns->conflict_count );
+	if( strcmp( current, ns->responder.hostname ) == 0 ) return;
 
-		if( pathlen < 6 || strcmp( path + pathlen - 6, ".local" ) != 0 ) continue;
+	SendGoodbyes();
+	ns->conflict_count = 0;
+	ReloadHostname();
+	StartProbing();
+}
 
-		uint16_t record_type = ( dataptr[0] << 8 ) | dataptr[1];
+#ifdef MDNS_LOOKUPS
+// buf must have 2 bytes free in front of it, for the TCP length.
+static int SendResolverReply( const struct resolver_client * client, uint8_t * buf, int len, int flags )
+{
+	if( !client->is_stream )
+		return sendto( client->sock, buf, len, MSG_NOSIGNAL | flags, (struct sockaddr*)&client->sender, client->sl );
+
+	// One send, so replies from forwarders sharing the connection don't interleave.
+	buf -= 2;
+	buf[0] = len >> 8;
+	buf[1] = len;
+	return ( send( client->sock, buf, len + 2, MSG_NOSIGNAL | flags ) == len + 2 ) ? len : -1;
+}
 
-		// Record class is not used.
-		//uint16_t record_class = ( dataptr[2] << 8 ) | dataptr[3];
+#ifndef DISABLE_RESOLVER
+static int OpenForwardSocket( int family )
+{
+	int sock = socket( family, SOCK_DGRAM, 0 );
+	if( sock < 0 )
+		return -1;
 
-		if( ( record_type == 1 ) || ( !is_ipv4_only && ( record_type == 28 ) ) )
-		{
-			is_a_suitable_mdns_record_query = 1;
-		}
+	// We would just hear our own question, and our own answer is not a forward.
+	int loopbackEnable = 0;
+	if( ( family == AF_INET && setsockopt( sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loopbackEnable, sizeof( loopbackEnable ) ) < 0 )
+#ifndef DISABLE_IPV6
+		|| ( family == AF_INET6 && setsockopt( sock, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loopbackEnable, sizeof( loopbackEnable ) ) < 0 )
+#endif
+		)
+	{
+		fprintf( stderr, "WARNING: Cannot prevent self-looping of mdns packets\n" );
+		close( sock );
+		return -1;
+	}
+	return sock;
+}
+
+// Asks the network on behalf of a resolver client, over IPv4 and IPv6 on every
+// interface, and answers the client once, with everything that came back
+// merged, and the addresses it's most likely to reach first.  trec, if
+// tracing, is committed by the caller, and we say when the reply went out.
+static void ForwardResolverQuery( const struct resolver_client * client, uint8_t * buffer, int r, struct trace_record * trec )
+{
+	uint32_t trec_seq = trec ? trec->seq : 0;
+	int pid_of_resolver = fork();
+
+	if( pid_of_resolver != 0 )
+	{
+		if( pid_of_resolver > 0 ) resolver_children = 1;
+		return;
+	}
+
+	// This is a fork()'d pid - from here on out we have to make sure to exit.
+	sigprocmask( SIG_SETMASK, &poll_sigmask, 0 );
+	uint8_t query[MDNS_FORWARD_QUERY_MAX];
+	uint8_t * rxbuf = malloc( MDNS_MAX_PACKET + 2 );
+	int querylen = MDNSBuildForwardQuery( buffer, r, query, sizeof( query ) );
+	struct mdns_answers set = { 0, MAX_RESOLVER_RECORDS, calloc( MAX_RESOLVER_RECORDS, sizeof( struct mdns_record ) ) };
+	struct pollfd fds[2] = { { .fd = -1, .events = POLLIN }, { .fd = -1, .events = POLLIN } };
+	int sent = 0, i;
+
+	if( !querylen || !set.records || !rxbuf )
+		exit( 0 );
+
+	// Out every interface we're on, not just the one the default route uses,
+	// so hosts on our other networks can be found too.
+	fds[0].fd = OpenForwardSocket( AF_INET );
+	for( i = 0; fds[0].fd >= 0 && i < ns->responder.num_ifaces; i++ )
+	{
+		struct ip_mreqn mreqn = { .imr_ifindex = ns->responder.ifaces[i].ifindex };
+		if( !ns->responder.ifaces[i].num4 ) continue;
+		if( setsockopt( fds[0].fd, IPPROTO_IP, IP_MULTICAST_IF, &mreqn, sizeof( mreqn ) ) == 0 &&
+			sendto( fds[0].fd, query, querylen, MSG_NOSIGNAL, (struct sockaddr*)&sin_multicast, sizeof( sin_multicast ) ) == querylen )
+			sent++;
+	}
+
+	// With no local IPv4 addresses, all we can do is let the routing table pick.
+	if( fds[0].fd >= 0 && !sent && sendto( fds[0].fd, query, querylen, MSG_NOSIGNAL, (struct sockaddr*)&sin_multicast, sizeof( sin_multicast ) ) == querylen )
+		sent++;
 
-		const char * path_first_dot = path;
-		const char * cpp = path;
-		while( *cpp && *cpp != '.' ) cpp++;
-		int dotlen = 0;
-		if( *cpp == '.' )
+#ifndef DISABLE_IPV6
+	if( !ns->responder.is_ipv4_only )
+		fds[1].fd = OpenForwardSocket( AF_INET6 );
+	for( i = 0; fds[1].fd >= 0 && i < ns->responder.num_ifaces; i++ )
+	{
+		struct sockaddr_in6 sin6 = {
+			.sin6_family = AF_INET6,
+			.sin6_addr = mdns_mcast6,
+			.sin6_port = htons( MDNS_PORT ),
+			.sin6_scope_id = ns->responder.ifaces[i].ifindex,
+		};
+		int ifindex = ns->responder.ifaces[i].ifindex;
+		if( !ns->responder.ifaces[i].num6 ) continue;
+		if( setsockopt( fds[1].fd, IPPROTO_IPV6, IPV6_MULTICAST_IF, &ifindex, sizeof( ifindex ) ) == 0 &&
+			sendto( fds[1].fd, query, querylen, MSG_NOSIGNAL, (struct sockaddr*)&sin6, sizeof( sin6 ) ) == querylen )
+			sent++;
+	}
+#endif
+
+	if( !sent )
+	{
+		fprintf( stderr, "WARNING: Could not repeat as MDNS request\n" );
+		exit( 0 );
+	}
+
+	// Once we have heard about the name, give other responders, and the
+	// other address family, a moment to come in too, then answer.
+	int64_t deadline = NowMS() + RESOLVER_TIMEOUT_MS;
+	int heard = 0;
+	int64_t now;
+	while( ( now = NowMS() ) < deadline )
+	{
+		if( poll( fds, 2, deadline - now ) <= 0 )
+			continue;
+
+		for( i = 0; i < 2; i++ )
 		{
-			path_first_dot = cpp+1;
-			dotlen = path_first_dot - path - 1;
+			if( !( fds[i].revents & POLLIN ) ) continue;
+			int rxlen = recv( fds[i].fd, rxbuf, MDNS_MAX_PACKET, 0 );
+			if( rxlen <= 0 || !MDNSCollectRecords( rxbuf, rxlen, &set ) ) continue;
+
+			if( !heard && MDNSAnswerStatus( query, querylen, &set ) != MDNS_ANSWER_NONE )
+			{
+				heard = 1;
+				deadline = NowMS() + RESOLVER_GRACE_MS;
+			}
 		}
+	}
+
+	// The name exists but without the record asked for is NODATA, which is an
+	// empty answer, not NXDOMAIN.
+	int status = MDNSAnswerStatus( query, querylen, &set );
+	MDNSRankAnswers( &ns->responder, &set );
+	r = MDNSBuildDNSResponse( buffer, r, &set, ( status == MDNS_ANSWER_NONE ) ? 3 /*NXDOMAIN*/ : 0,
+		client->is_stream, rxbuf + 2, MDNS_MAX_PACKET );
+	if( r && SendResolverReply( client, rxbuf + 2, r, 0 ) >= 0 )
+		TraceLateSent( trec, trec_seq );
+	else if( r && client->is_stream )
+	{
+		// Some of the reply may have gone, so nothing after it on the
+		// connection could be read right.
+		shutdown( client->sock, SHUT_RDWR );
+	}
+	exit( 0 );
+}
+#endif
+
+static uint32_t CacheNow( void )
+{
+	return NowMS() / 1000;
+}
+
+// Builds the answer to query from the cache.  Returns 0 unless the cache has
+// what was asked for, or always if it's too late to ask the network.
+static int AnswerFromCache( uint8_t * query, int querylen, int is_stream, int is_final, uint8_t * out, int outmax )
+{
+	struct mdns_record found[MAX_LOOKUP_RECORDS];
+	struct mdns_answers set = { 0, MAX_LOOKUP_RECORDS, found };
+
+	if( !cache.records ) return 0;
+	int status = MDNSCacheLookup( &cache, query, querylen, CacheNow(), &set );
+	if( status != MDNS_ANSWER_FOUND && !is_final ) return 0;
+
+	MDNSRankAnswers( &ns->responder, &set );
+	return MDNSBuildDNSResponse( query, querylen, &set, ( status == MDNS_ANSWER_NONE ) ? 3 /*NXDOMAIN*/ : 0,
+		is_stream, out, outmax );
+}
+
+static void CheckLookups( void );
+#endif
+
+static inline void HandleRX( int sock, int is_resolver )
+{
+	uint8_t buffer[MDNS_MAX_PACKET];
+	uint8_t * outbuff = replybuf + 2;
+
+	struct sockaddr_in6 sender = { 0 };
+	socklen_t sl = sizeof( sender );
+
+	// Using recvmsg
+
+	// This is a little tricky - so we can avoid having a separate socket for every single
+	// interface, we can instead, just recvmsg and discern which interfaces the message
+	// came frmo.
+
+	// if you want access to the data you need to init the msg_iovec fields
+	struct iovec iov = {
+		.iov_base = buffer,
+		.iov_len = sizeof( buffer ),
+	};
+	// Room for both PKTINFOs, and the timestamps with -T.
+	uint8_t cmbuf[256];
+	struct msghdr msghdr = {
+		.msg_name = &sender,
+		.msg_namelen = sizeof( sender ),
+		.msg_control = cmbuf,
+		.msg_controllen = sizeof( cmbuf ),
+		.msg_flags = 0,
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+
+	struct trace_record * trec = TraceBegin( sock );
+
+	int r = recvmsg( sock, &msghdr, 0 );
+
+	if( r < 0 || msghdr.msg_flags & (MSG_TRUNC | MSG_CTRUNC) )
+	{
+		// This should basically never happen.
+		return;
+	}
+
+	struct mdns_rxinfo rx = { 0 };
+	rx.is_resolver = is_resolver && resolver >= 0;
+
+	for ( struct cmsghdr *cmsg = CMSG_FIRSTHDR( &msghdr );
+    		cmsg != NULL;
+    		cmsg = CMSG_NXTHDR( &msghdr, cmsg ) )
+	{
+		// ignore the control headers that don't match what we want
+		// see https://stackoverflow.com/a/5309155/2926815
+		if ( cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO )
+		{
+			struct in_pktinfo * pi = (struct in_pktinfo *)CMSG_DATA(cmsg);
+			// at this point, peeraddr is the source sockaddr
+			// pi->ipi_spec_dst is the destination in_addr
+			// pi->ipi_addr is the destination address, in_addr
+			rx.local_addr_4 = pi->ipi_spec_dst;
+			rx.rxinterface = pi->ipi_ifindex;
+			// pi->ipi_addr is actually the multicast address.
+			rx.ipv4_valid = 1;
+		}
+#ifndef DISABLE_IPV6
+		else if( cmsg->cmsg_level == IPPROTO_IPV6 && 
+				( cmsg->cmsg_type == IPV6_PKTINFO || cmsg->cmsg_type == IPV6_RECVPKTINFO ) )
+		{
+			// Some build platforms do not include this.
+			struct in6_pktinfo_shadow
+			{
+				struct in6_addr ipi6_addr;	/* src/dst IPv6 address */
+				unsigned int ipi6_ifindex;	/* send/recv interface index */
+			};
+
+			struct in6_pktinfo_shadow * pi = (struct in6_pktinfo_shadow *)CMSG_DATA(cmsg);
+
+			rx.local_addr_6 = pi->ipi6_addr;
+			rx.ipv6_valid = 1;
+			rx.rxinterface = pi->ipi6_ifindex;
+		}
+#endif
 		else
-			path_first_dot = 0;
+		{
+			TraceRxCmsg( trec, cmsg );
+		}
+	}
 
-		if( hostname[0] && dotlen && dotlen == hostnamelen && memcmp( hostname, path, dotlen ) == 0 )
+	// Tricky - if ipv4 is valid, that means the ipv6 address is not to be trusted.
+	// it's the broadcast address.
+#ifndef DISABLE_IPV6
+	if( rx.ipv4_valid ) rx.ipv6_valid = 0;
+#endif
+
+	int outlen = 0;
+	int forwarded = 0;
+	int action = MDNSProcessPacket( &ns->responder, &rx, buffer, r, outbuff, &outlen );
+
+	if( trec )
+	{
+		trec->process_ns = TraceNow();
+		trec->action = action;
+		trec->len = r;
+	}
+
+	// Until probing is done, the name is not ours to answer for, but we do
+	// need to hear if someone else is answering for it.
+	if( ns->is_probing && !is_resolver )
+	{
+		int conflict = MDNSIsConflict( &ns->responder, MDNSFindIface( &ns->responder, rx.rxinterface ), buffer, r );
+		if( conflict == MDNS_CONFLICT_NAME )
+			HandleNameConflict();
+		else if( conflict == MDNS_CONFLICT_PROBE )
+			DeferProbing();
+		if( action == MDNS_ACTION_REPLY )
+			action = MDNS_ACTION_NONE;
+	}
+
+	switch( action )
+	{
+	case MDNS_ACTION_REPLY:
+		TraceSendTo( trec, sock, outbuff, outlen, (struct sockaddr*)&sender, sl );
+#ifndef DISABLE_IPV6
+		if( rx.ipv6_valid )
+			SendMulticast6( rx.rxinterface, outbuff, outlen );
+		else
+#endif
+		SendMulticastReply( &rx.local_addr_4, 0, outbuff, outlen );
+		break;
+	case MDNS_ACTION_UNICAST:
+		TraceSendTo( trec, sock, outbuff, outlen, (struct sockaddr*)&sender, sl );
+		break;
+#ifndef DISABLE_RESOLVER
+	case MDNS_ACTION_FORWARD:
+	{
+		// Only fork to ask the network if we haven't already heard the answer.
+		struct resolver_client client = { .sock = sock, .sender = sender, .sl = sl };
+		outlen = AnswerFromCache( buffer, r, 0, 0, outbuff, MDNS_MAX_PACKET );
+		if( outlen )
+			TraceSendTo( trec, sock, outbuff, outlen, (struct sockaddr*)&sender, sl );
+		else
+		{
+			ForwardResolverQuery( &client, buffer, r, trec );
+			forwarded = 1;
+		}
+		break;
+	}
+#endif
+	}
+
+#ifdef MDNS_LOOKUPS
+	// Responses from peers, for the resolver and NSS lookups, which are only
+	// served in our own namespace, so only hear peers there.  This is after
+	// our reply is out, since answering a lookup reuses replybuf.
+	if( cache.records && !is_resolver && ns == netns[0] && r >= 12 && ( buffer[2] & 0x80 ) &&
+		MDNSCacheRecords( buffer, r, &cache, CacheNow() ) )
+	{
+		CheckLookups();
+	}
+#endif
+
+	// Responses, including our own looped back, and queries that aren't for
+	// us, aren't worth the room in the ring.
+	if( trec && action != MDNS_ACTION_NONE )
+	{
+		if( !forwarded ) trec->sent_ns = TraceNow();
+		TraceCommit( trec );
+	}
+}
+
+#ifdef MDNS_LOOKUPS
+static void CloseResolverConn( int i );
+
+static void AcceptResolverConn( int listener )
+{
+	int is_local = ( listener == nss_listener );
+	int first = is_local ? MAX_RESOLVER_CONNS : 0;
+	int last = is_local ? MAX_CONNS : MAX_RESOLVER_CONNS;
+	int i, slot = -1;
+	int sock = accept( listener, 0, 0 );
+	if( sock < 0 ) return;
+
+	// Forwarders write their replies from their own processes, blocking, so
+	// they must give up on a client that stops reading.
+	struct timeval tv = { RESOLVER_TCP_SEND_TIMEOUT_MS / 1000, ( RESOLVER_TCP_SEND_TIMEOUT_MS % 1000 ) * 1000 };
+	if( !is_local && setsockopt( sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof( tv ) ) != 0 )
+	{
+		close( sock );
+		return;
+	}
+
+	// Any local user can connect, so a full pool mustn't turn everyone away
+	// until the idle timeout.  Make room by closing the quietest connection.
+	for( i = first; i < last; i++ )
+	{
+		if( !resolver_conns[i] )
 		{
-			uint8_t outbuff[MAX_MDNS_PATH*2+128];
-			uint8_t * obptr = outbuff;
-			uint16_t * obb = (uint16_t*)outbuff;
+			slot = i;
+			break;
+		}
+		if( slot < 0 || resolver_conns[i]->last_active < resolver_conns[slot]->last_active )
+			slot = i;
+	}
+	if( resolver_conns[slot] )
+		CloseResolverConn( slot );
+
+	resolver_conns[slot] = calloc( 1, sizeof( struct resolver_conn ) );
+	if( !resolver_conns[slot] )
+	{
+		close( sock );
+		return;
+	}
+	resolver_conns[slot]->sock = sock;
+	resolver_conns[slot]->is_local = is_local;
+	resolver_conns[slot]->last_active = NowMS();
+}
+
+static void CloseResolverConn( int i )
+{
+	close( resolver_conns[i]->sock );
+	free( resolver_conns[i] );
+	resolver_conns[i] = 0;
+}
 
-			int sendA = ( record_type == 1 /*A*/ && ipv4_valid );
+// Asks the network from our own MDNS socket, the way any MDNS querier would,
+// so the answers come back to us multicast, and go in the cache.
+static void StartLookup( struct resolver_conn * conn, uint8_t * query, int querylen )
+{
+	uint8_t out[MDNS_FORWARD_QUERY_MAX];
+	int len = MDNSBuildForwardQuery( query, querylen, out, sizeof( out ) );
+	int i;
+
+	conn->pending = 1;
+	conn->heard = 0;
+	conn->deadline = NowMS() + RESOLVER_TIMEOUT_MS;
+	if( !len ) return;
+
+	// RFC6762 Section 18.1, multicast queries have an ID of 0.
+	((uint16_t*)out)[0] = 0;
+	for( i = 0; i < ns->responder.num_ifaces; i++ )
+	{
+		const struct mdns_iface * iface = &ns->responder.ifaces[i];
+		if( iface->num4 )
+			SendMulticastReply( (struct in_addr*)&iface->addr4[0], 0, out, len );
 #ifndef DISABLE_IPV6
-			int sendAAAA = ( record_type == 28 /*AAAA*/ && ipv6_valid );
-#else
-			int sendAAAA = 0;
+		if( iface->num6 && ns->is_bound_6 )
+			SendMulticast6( iface->ifindex, out, len );
 #endif
+	}
+}
+
+// Returns -1 if the connection should be closed.
+static int ProcessConnQueries( struct resolver_conn * conn )
+{
+	uint8_t * outbuff = replybuf;
+	struct resolver_client client = { .sock = conn->sock, .is_stream = 1 };
+
+	// There may be any number of queries in here, and part of the next.
+	// Replies go out in order, so stop at one that's waiting on the network.
+	while( conn->len >= 2 && !conn->pending )
+	{
+		int msglen = ( conn->buf[0] << 8 ) | conn->buf[1];
+		if( msglen > RESOLVER_TCP_MAX_QUERY ) return -1;
+		if( conn->len < msglen + 2 ) break;
+
+		struct mdns_rxinfo rx = { .is_resolver = 1, .is_stream = 1 };
+		struct trace_record * trec = TraceBeginConn( conn->sock );
+		int outlen = 0;
+		int action = MDNSProcessPacket( &ns->responder, &rx, conn->buf + 2, msglen, outbuff + 2, &outlen );
+
+		if( trec )
+		{
+			trec->process_ns = TraceNow();
+			trec->action = action;
+			trec->len = msglen;
+		}
 
-			if( sendA || sendAAAA )
+		if( action == MDNS_ACTION_FORWARD )
+		{
+			outlen = AnswerFromCache( conn->buf + 2, msglen, 1, 0, outbuff + 2, MDNS_MAX_PACKET );
+			if( outlen )
+				action = MDNS_ACTION_UNICAST;
+			else if( conn->is_local )
 			{
-				*(obb++) = xactionid;
-				*(obb++) = htons(0x8400); //Authortative response.
-				*(obb++) = 0;
-				*(obb++) = htons( 1 ); //1 answer.
-				*(obb++) = 0;
-				*(obb++) = 0;
-
-				obptr = (uint8_t*)obb;
-
-				// Answer
-				memcpy( obptr, namestartptr, stlen+1 ); //Hack: Copy the name in.
-				obptr += stlen+1;
-				*(obptr++) = 0;
-				*(obptr++) = 0x00; *(obptr++) = (sendA ? 0x01 : 0x1c ); // A record
-				*(obptr++) = 0x80; *(obptr++) = 0x01; //Flush cache + in ptr.
-				*(obptr++) = 0x00; *(obptr++) = 0x00; //TTL
-				*(obptr++) = 0x00; *(obptr++) = 240;  //240 seconds (4 minutes)
+				// Answered by FinishLookup, once we've heard from the network.
+				conn->trec = trec;
+				conn->trec_seq = trec ? trec->seq : 0;
+				TraceCommit( trec );
+				StartLookup( conn, conn->buf + 2, msglen );
+				break;
 			}
-
-			if( sendA )
+#ifndef DISABLE_RESOLVER
+			else
 			{
-				*(obptr++) = 0x00; *(obptr++) = 0x04; //Size 4 (IP)
-				memcpy( obptr, &local_addr_4.s_addr, 4 );
-				obptr+=4;
+				ForwardResolverQuery( &client, conn->buf + 2, msglen, trec );
+				TraceCommit( trec );
 			}
-#ifndef DISABLE_IPV6
-			else if( sendAAAA )
+#endif
+		}
+
+		if( action == MDNS_ACTION_UNICAST )
+		{
+			if( SendResolverReply( &client, outbuff + 2, outlen, MSG_DONTWAIT ) < 0 )
+				return -1;
+			if( trec )
 			{
-				*(obptr++) = 0x00; *(obptr++) = 0x10; //Size 16 (IPv6)
-				memcpy( obptr, &local_addr_6.s6_addr, 16 );
-				obptr+=16;
+				trec->sent_ns = TraceNow();
+				TraceCommit( trec );
 			}
+		}
+
+		conn->len -= msglen + 2;
+		memmove( conn->buf, conn->buf + msglen + 2, conn->len );
+	}
+	return 0;
+}
+
+// Answers a lookup that was waiting on the network, with whatever we heard.
+static int FinishLookup( struct resolver_conn * conn )
+{
+	uint8_t * outbuff = replybuf;
+	struct resolver_client client = { .sock = conn->sock, .is_stream = 1 };
+	int msglen = ( conn->buf[0] << 8 ) | conn->buf[1];
+	int outlen = AnswerFromCache( conn->buf + 2, msglen, 1, 1, outbuff + 2, MDNS_MAX_PACKET );
+
+	conn->pending = 0;
+	conn->last_active = NowMS();
+	conn->len -= msglen + 2;
+	memmove( conn->buf, conn->buf + msglen + 2, conn->len );
+
+	if( outlen && SendResolverReply( &client, outbuff + 2, outlen, MSG_DONTWAIT ) < 0 )
+		return -1;
+	if( outlen )
+		TraceLateSent( conn->trec, conn->trec_seq );
+	conn->trec = 0;
+	return ProcessConnQueries( conn );
+}
+
+// Something new went in the cache.  Once we've heard about a name being
+// looked up, give the other address family a moment to come in, then answer.
+static void CheckLookups( void )
+{
+	// Whether we've heard anything about the name is all that matters here.
+	struct mdns_record found;
+	struct mdns_answers set = { 0, 1, &found };
+	int i;
+
+	for( i = 0; i < MAX_CONNS; i++ )
+	{
+		struct resolver_conn * conn = resolver_conns[i];
+		if( !conn || !conn->pending || conn->heard ) continue;
+		int msglen = ( conn->buf[0] << 8 ) | conn->buf[1];
+		if( MDNSCacheLookup( &cache, conn->buf + 2, msglen, CacheNow(), &set ) != MDNS_ANSWER_NONE )
+		{
+			conn->heard = 1;
+			conn->deadline = NowMS() + RESOLVER_GRACE_MS;
+		}
+	}
+}
+
+// Returns -1 if the connection should be closed.
+static int HandleResolverConn( struct resolver_conn * conn )
+{
+	// Never block in here.  The socket itself is left blocking, because
+	// forwarders write their replies to it from their own processes.
+	int r = recv( conn->sock, conn->buf + conn->len, sizeof( conn->buf ) - conn->len, MSG_DONTWAIT );
+	if( r < 0 && ( errno == EAGAIN || errno == EINTR ) ) return 0;
+	if( r <= 0 ) return -1;
+	conn->len += r;
+	conn->last_active = NowMS();
+
+	return ProcessConnQueries( conn );
+}
+
+// Answers lookups that are done waiting, closes idle connections, and
+// returns how long until the next of those, or -1.
+static int ExpireResolverConns( void )
+{
+	int64_t now = NowMS();
+	int timeout = -1;
+	int i;
+	for( i = 0; i < MAX_CONNS; i++ )
+	{
+		struct resolver_conn * conn = resolver_conns[i];
+		if( !conn ) continue;
+		if( conn->pending && conn->deadline <= now && FinishLookup( conn ) < 0 )
+		{
+			CloseResolverConn( i );
+			continue;
+		}
+		int64_t left = conn->pending ? conn->deadline - now : conn->last_active + RESOLVER_TCP_IDLE_MS - now;
+		if( left <= 0 )
+			CloseResolverConn( i );
+		else if( timeout < 0 || left < timeout )
+			timeout = left;
+	}
+	return timeout;
+}
+
+static void AllocateCache( void )
+{
+	if( cache.records || ( resolver < 0 && nss_listener < 0 ) ) return;
+	cache.max = MAX_CACHE_RECORDS;
+	cache.records = calloc( MAX_CACHE_RECORDS, sizeof( struct mdns_record ) );
+}
+#endif
+
+#ifndef DISABLE_RESOLVER
+static int OpenResolverTCP( const struct sockaddr * addr, socklen_t addrlen )
+{
+	int optval = 1;
+	int sock = socket( addr->sa_family, SOCK_STREAM, 0 );
+	if( sock < 0 ) return -1;
+
+	if( ( addr->sa_family == AF_INET6 && setsockopt( sock, IPPROTO_IPV6, IPV6_V6ONLY, &optval, sizeof( optval ) ) != 0 ) ||
+		setsockopt( sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof( optval ) ) != 0 ||
+		bind( sock, addr, addrlen ) != 0 || listen( sock, MAX_RESOLVER_CONNS ) != 0 )
+	{
+		close( sock );
+		return -1;
+	}
+	return sock;
+}
+
+static void CloseResolver( void )
+{
+	int i;
+	TraceDisable( resolver );
+	TraceDisable( resolver6 );
+	if( resolver >= 0 ) close( resolver );
+	if( resolver6 >= 0 ) close( resolver6 );
+	if( resolver_tcp >= 0 ) close( resolver_tcp );
+	if( resolver6_tcp >= 0 ) close( resolver6_tcp );
+	resolver = resolver6 = resolver_tcp = resolver6_tcp = -1;
+
+	for( i = 0; i < MAX_RESOLVER_CONNS; i++ )
+	{
+		if( resolver_conns[i] )
+			CloseResolverConn( i );
+	}
+}
+
+static int OpenResolver( void )
+{
+	resolver = socket( AF_INET, SOCK_DGRAM, 0 );
+	if( resolver < 0 )
+	{
+		fprintf( stderr, "FATAL: Resolver requested but unavailable.\n" );
+		resolver = -1;
+		return -5;
+	}
+
+	// The resolver uses child processes.  To clean up zombies, we catch SIGCHILD.
+	//signal( SIGCHLD, &ChildProcessComplete );
+
+	int optval = 1;
+	if ( setsockopt( resolver, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof( optval ) ) != 0 )
+	{
+		fprintf( stderr, "WARNING: Could not set SO_REUSEPORT on resolver\n" );
+		CloseResolver();
+		return -5;
+	}
+	struct sockaddr_in sin_resolve = {
+		.sin_family = AF_INET,
+		.sin_addr = { inet_addr( RESOLVER_IP ) },
+		.sin_port = htons( RESOLVER_PORT )
+	};
+	if ( bind( resolver, (struct sockaddr *)&sin_resolve, sizeof(sin_resolve) ) == -1 )
+	{
+		fprintf( stderr, "FATAL: Could not bind to IPv4 MDNS port (%d %s)\n", errno, strerror( errno ) );
+		CloseResolver();
+		return -5;
+	}
+	printf( "Resolver configured on \"%s\"\n", RESOLVER_IP );
+
+#ifndef DISABLE_IPV6
+	// For IPv6-only clients.  Not having this is not worth stopping over.
+	struct sockaddr_in6 sin6_resolve = {
+		.sin6_family = AF_INET6,
+		.sin6_port = htons( RESOLVER_PORT )
+	};
+	inet_pton( AF_INET6, RESOLVER_IP6, &sin6_resolve.sin6_addr );
+	resolver6 = socket( AF_INET6, SOCK_DGRAM, 0 );
+	if( resolver6 < 0 ||
+		setsockopt( resolver6, IPPROTO_IPV6, IPV6_V6ONLY, &optval, sizeof( optval ) ) != 0 ||
+		setsockopt( resolver6, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof( optval ) ) != 0 ||
+		bind( resolver6, (struct sockaddr *)&sin6_resolve, sizeof(sin6_resolve) ) == -1 )
+	{
+		fprintf( stderr, "WARNING: Could not bind resolver to \"%s\" (%d %s)\n", RESOLVER_IP6, errno, strerror( errno ) );
+		if( resolver6 >= 0 ) close( resolver6 );
+		resolver6 = -1;
+	}
+	else
+	{
+		printf( "Resolver configured on \"%s\"\n", RESOLVER_IP6 );
+	}
+#endif
+
+	// And over TCP, on the same addresses.
+	resolver_tcp = OpenResolverTCP( (struct sockaddr *)&sin_resolve, sizeof( sin_resolve ) );
+	if( resolver_tcp < 0 )
+		fprintf( stderr, "WARNING: Could not listen for TCP on \"%s\" (%d %s)\n", RESOLVER_IP, errno, strerror( errno ) );
+#ifndef DISABLE_IPV6
+	if( resolver6 >= 0 )
+	{
+		resolver6_tcp = OpenResolverTCP( (struct sockaddr *)&sin6_resolve, sizeof( sin6_resolve ) );
+		if( resolver6_tcp < 0 )
+			fprintf( stderr, "WARNING: Could not listen for TCP on \"%s\" (%d %s)\n", RESOLVER_IP6, errno, strerror( errno ) );
+	}
+#endif
+
+	if( trace_path )
+	{
+		TraceEnable( resolver );
+		if( resolver6 >= 0 ) TraceEnable( resolver6 );
+	}
+	return 0;
+}
+#endif
+
+#ifndef DISABLE_NSS
+// For the NSS module.  If another instance is already serving the socket,
+// leave it be, otherwise it's left over, and ours to replace.
+static int OpenNSSListener( void )
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX, .sun_path = MINIMDNSD_SOCKET };
+	int sock = socket( AF_UNIX, SOCK_STREAM, 0 );
+	if( sock < 0 ) return -1;
+
+	if( connect( sock, (struct sockaddr *)&sun, sizeof( sun ) ) == 0 )
+	{
+		fprintf( stderr, "WARNING: Another minimdnsd is already serving \"%s\"\n", MINIMDNSD_SOCKET );
+		close( sock );
+		return -1;
+	}
+	close( sock );
+	unlink( MINIMDNSD_SOCKET );
+
+	sock = socket( AF_UNIX, SOCK_STREAM, 0 );
+	if( sock < 0 || bind( sock, (struct sockaddr *)&sun, sizeof( sun ) ) != 0 ||
+		chmod( MINIMDNSD_SOCKET, 0666 ) != 0 || listen( sock, MAX_NSS_CONNS ) != 0 )
+	{
+		fprintf( stderr, "WARNING: Could not listen on \"%s\" (%d %s)\n", MINIMDNSD_SOCKET, errno, strerror( errno ) );
+		if( sock >= 0 ) close( sock );
+		return -1;
+	}
+	printf( "NSS lookups on \"%s\"\n", MINIMDNSD_SOCKET );
+	return sock;
+}
+
+#ifndef DISABLE_CONFIG
+static void CloseNSSListener( void )
+{
+	int i;
+	close( nss_listener );
+	unlink( MINIMDNSD_SOCKET );
+	nss_listener = -1;
+
+	for( i = MAX_RESOLVER_CONNS; i < MAX_CONNS; i++ )
+	{
+		if( resolver_conns[i] )
+			CloseResolverConn( i );
+	}
+}
+#endif
+#endif
+
+// Opens the MDNS and netlink sockets for ns, in whatever namespace we are in.
+static int OpenMDNSSockets( void )
+{
+	int optval = 1;
+
+#ifndef DISABLE_IPV6
+	if( !ns->responder.is_ipv4_only )
+	{
+		ns->sdsock = socket( AF_INET6, SOCK_DGRAM, 0 );
+		if ( ns->sdsock < 0 )
+		{
+			fprintf( stderr, "WARNING: Opening IPv6 datagram socket error.  Trying IPv4");
+			ns->sdsock = socket( AF_INET, SOCK_DGRAM, 0 );
+			ns->is_bound_6 = 0;
+		}
+		else
+		{
+			ns->is_bound_6 = 1;
+		}
+	}
+	else
+	{
+#endif
+	ns->sdsock = socket( AF_INET, SOCK_DGRAM, 0 );
+	if ( ns->sdsock < 0 )
+	{
+		fprintf( stderr, "FATAL: Could not open IPv4 Socket\n");
+		return -1;
+	}
+#ifndef DISABLE_IPV6
+	}
+#endif
+
+	// Not just avahi, but other services, too will bind to 5353, but we can use
+	// SO_REUSEPORT to allow multiple people to bind simultaneously.
+	if ( setsockopt( ns->sdsock, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof( optval ) ) != 0 )
+	{
+		fprintf( stderr, "WARNING: Could not set SO_REUSEPORT\n" );
+	}
+
+	if ( setsockopt( ns->sdsock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof( optval ) ) != 0 )
+	{
+		fprintf( stderr, "WARNING: Could not set SO_REUSEADDR\n" );
+	}
+
+	// We have to enable PKTINFO so we can use recvmsg, so we can get desination address
+	// so we can reply accordingly.
+	if( setsockopt( ns->sdsock, IPPROTO_IP, IP_PKTINFO, &optval, sizeof( optval ) ) != 0 )
+	{
+		fprintf( stderr, "Fatal: OS Does not support IP_PKTINFO on IPv6 socket.\n" );
+		return -9;
+	}
+
+#ifndef DISABLE_IPV6
+	if( ns->is_bound_6 && setsockopt( ns->sdsock, IPPROTO_IPV6, IPV6_RECVPKTINFO, &optval, sizeof( optval ) ) != 0 )
+	{
+		fprintf( stderr, "Fatal: OS Does not support IP_PKTINFO on IPv6 socket.\n" );
+		return -9;
+	}
+
+	// RFC6762 Section 11, a TTL of 255 lets peers tell we are on the local link.
+	int hops = 255;
+	if( ns->is_bound_6 && setsockopt( ns->sdsock, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &hops, sizeof( hops ) ) != 0 )
+	{
+		fprintf( stderr, "WARNING: Could not set IPV6_MULTICAST_HOPS\n" );
+	}
+#endif
+
+	ns->sdifaceupdown = socket( PF_NETLINK, SOCK_RAW, NETLINK_ROUTE );
+	if ( ns->sdifaceupdown < 0 )
+	{
+		fprintf( stderr, "WARNING: Couldn't open socket for monitoring address changes.\n");
+	}
+	else
+	{
+		// Bind looking for interface changes.
+		struct sockaddr_nl addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.nl_family = AF_NETLINK;
+		addr.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+		if (bind( ns->sdifaceupdown, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+		{
+			fprintf( stderr, "WARNING: couldn't bind looking for address changes\n" );
+			close( ns->sdifaceupdown );
+			ns->sdifaceupdown = -1;
+		}
+	}
+
+	// Bind the normal MDNS socket
+#ifndef DISABLE_IPV6
+	if( ns->is_bound_6 )
+	{
+		struct sockaddr_in6 sin6 = {
+			.sin6_family = AF_INET6,
+			.sin6_addr = IN6ADDR_ANY_INIT,
+			.sin6_port = htons( MDNS_PORT )
+		};
+		if ( bind( ns->sdsock, (struct sockaddr *)&sin6, sizeof(sin6) ) == -1 )
+		{
+			fprintf( stderr, "FATAL: Could not bind to IPv6 MDNS port (%d %s)\n", errno, strerror( errno ) );
+			return -1;
+		}
+	}
+	else
+#endif
+	{
+		struct sockaddr_in sin = {
+			.sin_family = AF_INET,
+			.sin_addr = { INADDR_ANY },
+			.sin_port = htons( MDNS_PORT )
+		};
+		if ( bind( ns->sdsock, (struct sockaddr *)&sin, sizeof(sin) ) == -1 )
+		{
+			fprintf( stderr, "FATAL: Could not bind to IPv4 MDNS port (%d %s)\n", errno, strerror( errno ) );
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void UseNetns( struct mdns_netns * n )
+{
+	ns = n;
+#ifndef DISABLE_NETNS
+	if( n->nsfd < 0 || n->nsfd == current_nsfd ) return;
+	if( setns( n->nsfd, CLONE_NEWNET ) != 0 )
+	{
+		fprintf( stderr, "WARNING: Could not enter netns \"%s\" (%d %s)\n", n->name, errno, strerror( errno ) );
+		return;
+	}
+	current_nsfd = n->nsfd;
+#endif
+}
+
+#ifndef DISABLE_NETNS
+static void CloseNetnsSockets( struct mdns_netns * n )
+{
+	if( n->sdsock >= 0 ) close( n->sdsock );
+	if( n->sdifaceupdown >= 0 ) close( n->sdifaceupdown );
+	if( n->hostname_watch >= 0 ) inotify_rm_watch( inotifyfd, n->hostname_watch );
+	if( n->nsfd >= 0 ) close( n->nsfd );
+}
+
+static int IsNetnsWanted( const char * name )
+{
+	int i;
+	if( config.netns_all ) return 1;
+	for( i = 0; i < config.num_netns; i++ )
+	{
+		if( strcmp( config.netns[i], name ) == 0 ) return 1;
+	}
+	return 0;
+}
+
+static int FindNetns( const char * name )
+{
+	int i;
+	for( i = 1; i < num_netns; i++ )
+	{
+		if( strcmp( netns[i]->name, name ) == 0 ) return i;
+	}
+	return -1;
+}
+
+// Returns -1 if the namespace isn't ready yet, "ip netns add" creates the
+// file before it mounts the namespace on it.
+static int AddNetns( const char * name )
+{
+	char path[PATH_MAX];
+
+	if( num_netns >= MAX_NETNS )
+	{
+		fprintf( stderr, "WARNING: Too many namespaces, not serving netns \"%s\"\n", name );
+		return 0;
+	}
+
+	struct mdns_netns * n = calloc( 1, sizeof( *n ) );
+	snprintf( n->name, sizeof( n->name ), "%s", name );
+	n->sdsock = n->sdifaceupdown = n->hostname_watch = -1;
+	n->responder.ttl = config.ttl;
+	n->responder.is_ipv4_only = config.ipv4_only;
+
+	snprintf( path, sizeof( path ), NETNS_RUN_DIR "/%s", name );
+	n->nsfd = open( path, O_RDONLY | O_CLOEXEC );
+	if( n->nsfd < 0 || setns( n->nsfd, CLONE_NEWNET ) != 0 )
+	{
+		if( n->nsfd >= 0 ) close( n->nsfd );
+		free( n );
+		return -1;
+	}
+	current_nsfd = n->nsfd;
+	ns = n;
+
+	if( OpenMDNSSockets() < 0 )
+	{
+		fprintf( stderr, "WARNING: Could not open MDNS sockets in netns \"%s\"\n", name );
+		UseNetns( netns[0] );
+		CloseNetnsSockets( n );
+		free( n );
+		return 0;
+	}
+	netns[num_netns++] = n;
+
+	HandleRequestingInterfaces();
+	ReloadHostname();
+	WatchHostname();
+
+	RefreshInterfaces();
+	StartProbing();
+	return 0;
+}
+
+static void RemoveNetns( int i )
+{
+	struct mdns_netns * n = netns[i];
+
+	UseNetns( n );
+	SendGoodbyes();
+
+	// Before its descriptor is closed, and maybe reused for another.
+	UseNetns( netns[0] );
+	CloseNetnsSockets( n );
+	printf( "Leaving netns \"%s\"\n", n->name );
+	fflush( stdout );
+	free( n );
+
+	num_netns--;
+	memmove( &netns[i], &netns[i+1], ( num_netns - i ) * sizeof( netns[0] ) );
+}
+
+// Starts serving namespaces that have appeared under NETNS_RUN_DIR, and stops
+// serving those that have gone, or that we're no longer asked to.
+static void ScanNetns( void )
+{
+	char path[PATH_MAX];
+	struct dirent * de;
+	int i;
+
+	for( i = num_netns - 1; i > 0; i-- )
+	{
+		snprintf( path, sizeof( path ), NETNS_RUN_DIR "/%s", netns[i]->name );
+		if( access( path, F_OK ) != 0 || !IsNetnsWanted( netns[i]->name ) )
+			RemoveNetns( i );
+	}
+
+	int not_ready = 0;
+	DIR * dir = opendir( NETNS_RUN_DIR );
+	while( dir && ( de = readdir( dir ) ) )
+	{
+		if( de->d_name[0] == '.' || !IsNetnsWanted( de->d_name ) || FindNetns( de->d_name ) >= 0 )
+			continue;
+		if( AddNetns( de->d_name ) < 0 )
+			not_ready = 1;
+	}
+	if( dir ) closedir( dir );
+	UseNetns( netns[0] );
+
+	// Anything that isn't a namespace after a few seconds isn't going to become one.
+	netns_retry = ( not_ready && netns_retries++ < NETNS_MAX_RETRIES ) ? NowMS() + NETNS_RETRY_MS : 0;
+}
+
+// From here on, sockets are made in whichever namespace they are for, so we
+// have to be able to come back to our own.
+static int StartNetns( void )
+{
+	if( netns[0]->nsfd >= 0 ) return 0;
+
+	netns[0]->nsfd = open( "/proc/self/ns/net", O_RDONLY | O_CLOEXEC );
+	current_nsfd = netns[0]->nsfd;
+
+	// Like "ip netns add" does, so there is something to watch.
+	mkdir( NETNS_RUN_DIR, 0755 );
+	netns_watch = inotify_add_watch( inotifyfd, NETNS_RUN_DIR, IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM );
+	if( netns[0]->nsfd < 0 || netns_watch < 0 )
+	{
+		fprintf( stderr, "FATAL: Cannot watch for network namespaces in \"%s\" (%d %s)\n", NETNS_RUN_DIR, errno, strerror( errno ) );
+		if( netns[0]->nsfd >= 0 ) close( netns[0]->nsfd );
+		netns[0]->nsfd = current_nsfd = -1;
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+// RFC2181 Section 8, TTLs are 31 bits.  And 0 would be a goodbye.
+#define MAX_TTL 2147483647
+
+// For -t and the ttl option.  Returns -1 unless value is just a number of
+// seconds, from 1 to MAX_TTL.
+static int ParseTTL( const char * value, uint32_t * ttl )
+{
+	char * end;
+
+	// strtoul would take leading space, and negative numbers, wrapped around.
+	if( *value < '0' || *value > '9' ) return -1;
+	errno = 0;
+	unsigned long v = strtoul( value, &end, 10 );
+	if( errno || *end || v < 1 || v > MAX_TTL ) return -1;
+	*ttl = v;
+	return 0;
+}
+
+#ifndef DISABLE_CONFIG
+static int ParseBool( const char * value )
+{
+	if( !strcmp( value, "yes" ) || !strcmp( value, "on" ) || !strcmp( value, "1" ) ) return 1;
+	if( !strcmp( value, "no" ) || !strcmp( value, "off" ) || !strcmp( value, "0" ) ) return 0;
+	return -1;
+}
+
+// The -c file has an "option value" per line, and # comments.  Options are
+// named after what they do on the command line, see minimdnsd.1.
+static int ParseConfigFile( const char * path, struct mdns_config * cfg )
+{
+	int fh = open( path, O_RDONLY );
+	if( fh < 0 )
+	{
+		fprintf( stderr, "WARNING: Can't open config \"%s\" (%d %s)\n", path, errno, strerror( errno ) );
+		return -1;
+	}
+	cfg->text = malloc( MAX_CONFIG_SIZE + 1 );
+	int len = read( fh, cfg->text, MAX_CONFIG_SIZE + 1 );
+	close( fh );
+	if( len < 0 || len > MAX_CONFIG_SIZE )
+	{
+		fprintf( stderr, "WARNING: Can't read config \"%s\"\n", path );
+		return -1;
+	}
+	cfg->text[len] = 0;
+
+	char * line, * next;
+	int lineno = 0;
+	for( line = cfg->text; line; line = next )
+	{
+		char * save;
+		next = strchr( line, '\n' );
+		if( next ) *next++ = 0;
+		lineno++;
+
+		char * comment = strchr( line, '#' );
+		if( comment ) *comment = 0;
+
+		char * option = strtok_r( line, " \t\r", &save );
+		char * value = strtok_r( 0, " \t\r", &save );
+		if( !option ) continue;
+
+		int b = value ? ParseBool( value ) : -1;
+		if( !value || strtok_r( 0, " \t\r", &save ) )
+			goto bad;
+		else if( !strcmp( option, "hostname" ) )
+			cfg->hostname = value;
+		else if( !strcmp( option, "ttl" ) )
+		{
+			if( ParseTTL( value, &cfg->ttl ) < 0 ) goto bad;
+		}
+		else if( !strcmp( option, "ipv4-only" ) && b >= 0 )
+			cfg->ipv4_only = b;
+#ifndef DISABLE_RESOLVER
+		else if( !strcmp( option, "resolver" ) && b >= 0 )
+			cfg->resolver = b;
+#endif
+#ifndef DISABLE_NSS
+		else if( !strcmp( option, "nss" ) && b >= 0 )
+			cfg->nss = b;
+#endif
+#ifndef DISABLE_NETNS
+		else if( !strcmp( option, "all-netns" ) && b >= 0 )
+			cfg->netns_all = b;
+		else if( !strcmp( option, "netns" ) && cfg->num_netns < MAX_NETNS - 1 )
+			cfg->netns[cfg->num_netns++] = value;
+#endif
+		else
+			goto bad;
+		continue;
+bad:
+		fprintf( stderr, "WARNING: %s:%d: Can't use \"%s\"\n", path, lineno, option );
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+// The -c file, with the command line on top.
+static int LoadConfig( struct mdns_config * cfg )
+{
+	int i;
+	memset( cfg, 0, sizeof( *cfg ) );
+	cfg->ttl = MDNS_DEFAULT_TTL;
+
+#ifndef DISABLE_CONFIG
+	if( config_path && ParseConfigFile( config_path, cfg ) < 0 )
+	{
+		free( cfg->text );
+		return -1;
+	}
 #endif
 
-			if( sendA || sendAAAA )
-			{
-				sendto( sock, outbuff, obptr - outbuff, MSG_NOSIGNAL, (struct sockaddr*)&sender, sl );
-
-				// Tricky: Make another socket to send
-				int socks_to_send = socket( AF_INET, SOCK_DGRAM, 0 );
-				//struct ip_mreqn txif = { 0 };
-				//txif.imr_multiaddr.s_addr = MDNS_BRD_ADDR;
-				//txif.imr_address.s_addr = local_addr_4.s_addr;
-				//txif.imr_ifindex = rxinterface;
-				rxinterface = rxinterface; // We aren't using this now, see note below.
-
-				// With IP_MULTICAST_IF you can either pass in an ip_mreqn, or just the local_addr4.
-				// We tried to do the full txif for clarity / example. But, it seems to cause issues?
-				if( setsockopt( socks_to_send, IPPROTO_IP, IP_MULTICAST_IF, &local_addr_4, sizeof(local_addr_4)) != 0 )
-				{
-					fprintf( stderr, "WARNING: Could not set IP_MULTICAST_IF for reply\n" );
-				}
+	if( args.hostname ) cfg->hostname = args.hostname;
+	if( args.ttl ) cfg->ttl = args.ttl;
+	cfg->ipv4_only |= args.ipv4_only;
+	cfg->resolver |= args.resolver;
+	cfg->nss |= args.nss;
+	cfg->netns_all |= args.netns_all;
+	for( i = 0; i < args.num_netns && cfg->num_netns < MAX_NETNS - 1; i++ )
+		cfg->netns[cfg->num_netns++] = args.netns[i];
+	return 0;
+}
 
-				int optval = 1;
-				if ( setsockopt( socks_to_send, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof( optval ) ) != 0 )
-				{
-					fprintf( stderr, "WARNING: Could not set SO_REUSEPORT for reply\n" );
-				}
-				struct sockaddr_in sin = {
-					.sin_family = AF_INET,
-					.sin_addr = { INADDR_ANY },
-					.sin_port = htons( MDNS_PORT )
-				};
-				if ( bind( socks_to_send, (struct sockaddr *)&sin, sizeof(sin) ) == -1 )
-				{
-					fprintf( stderr, "WARNING: When sending reply, could not bind to IPv4 MDNS port (%d %s)\n", errno, strerror( errno ) );
-				}
-				if ( sendto( socks_to_send, outbuff, obptr - outbuff, MSG_NOSIGNAL,
-					(struct sockaddr*)&sin_multicast, sizeof(sin_multicast) ) != obptr - outbuff )
-				{
-					fprintf( stderr, "WARNING: Could not send multicast reply for MDNS query\n" );
-				}
-				close( socks_to_send );
-			}
+#ifndef DISABLE_CONFIG
+// On SIGHUP, between polls.  The new configuration is checked as a whole
+// before anything changes, then only what is different is redone, so our
+// MDNS sockets, and their memberships, stay as they are.
+static void ReloadConfig( void )
+{
+	struct mdns_config cfg;
+	int i;
 
-			found = 1;
-		}
+	if( LoadConfig( &cfg ) < 0 )
+	{
+		fprintf( stderr, "WARNING: Keeping the configuration we have\n" );
+		return;
+	}
+	if( cfg.ipv4_only != config.ipv4_only )
+	{
+		fprintf( stderr, "WARNING: ipv4-only only changes with a restart\n" );
+		cfg.ipv4_only = config.ipv4_only;
 	}
 
+	// Peers should forget the old name before we start on a new one.
+	int renamed = !cfg.hostname != !config.hostname ||
+		( cfg.hostname && strcmp( cfg.hostname, config.hostname ) );
+	UseNetns( netns[0] );
+	if( renamed )
+		SendGoodbyes();
 
-	// We could also reply with services here.
+	free( config.text );
+	config = cfg;
 
-	// But, if we aren't sending a response, and we're a resolver, we have to do more work.
-//	printf( "CHECK: %d %d %d %d\n", found, is_resolver, resolver, is_an_a_mdns_record_query );
-	if( !found && is_resolver && resolver )
+	if( renamed )
 	{
-		// If we are resolving, just yolo this off to the rest of the network.
-		// As a note, Only IPv4 records are supported.  AAAA records seem to jank things up.
-		if( is_a_suitable_mdns_record_query )
+		if( config.hostname && ns->hostname_watch >= 0 )
+		{
+			inotify_rm_watch( inotifyfd, ns->hostname_watch );
+			ns->hostname_watch = -1;
+		}
+		else if( !config.hostname && ns->hostname_watch < 0 )
 		{
-			int pid_of_resolver = fork();
+			WatchHostname();
+		}
+		ns->conflict_count = 0;
+		ReloadHostname();
+		StartProbing();
+	}
 
-			if( pid_of_resolver == 0 )
-			{
-				// This is a fork()'d pid - from here on out we have to make sure to exit.
+#ifndef DISABLE_RESOLVER
+	if( config.resolver && resolver < 0 )
+		OpenResolver();
+	else if( !config.resolver && resolver >= 0 )
+		CloseResolver();
+#endif
+#ifndef DISABLE_NSS
+	if( config.nss && nss_listener < 0 )
+		nss_listener = OpenNSSListener();
+	else if( !config.nss && nss_listener >= 0 )
+		CloseNSSListener();
+#endif
+#ifdef MDNS_LOOKUPS
+	AllocateCache();
+#endif
 
-				#define MAX_IFACES_SOCKS
-				int socks_to_send = socket( AF_INET, SOCK_DGRAM, 0 );
-				if( !socks_to_send )
-				{
-					fprintf( stderr, "WARNING: Could not create multicast message\n" );
-					exit( 0 );
-				}
+	// Peers hear about a new TTL with a fresh announcement.
+	for( i = 0; i < num_netns; i++ )
+	{
+		if( netns[i]->responder.ttl == config.ttl ) continue;
+		UseNetns( netns[i] );
+		ns->responder.ttl = config.ttl;
+		StartAnnouncing();
+	}
 
-				int loopbackEnable = 0;
-				if( setsockopt( socks_to_send, IPPROTO_IP, IP_MULTICAST_LOOP, &loopbackEnable, sizeof( loopbackEnable ) ) < 0 )
-				{
-					fprintf( stderr, "WARNING: Cannot prevent self-looping of mdns packets\n" );
-					exit( 0 );
-				}
+#ifndef DISABLE_NETNS
+	if( config.netns_all || config.num_netns )
+		StartNetns();
+	if( netns[0]->nsfd >= 0 )
+	{
+		netns_retries = 0;
+		ScanNetns();
+	}
+#endif
 
-				struct timeval tv = { .tv_sec = 3 };
-				if( setsockopt( socks_to_send, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof( tv ) ) < 0 )
-				{
-					fprintf( stderr, "WARNING: Could not set sock option on repeated socket\n" );
-					close( socks_to_send );
-					exit( 0 );
-				}
+	printf( "Configuration reloaded\n" );
+	fflush( stdout );
+}
 
-				if( sendto( socks_to_send, buffer, r, MSG_NOSIGNAL, (struct sockaddr*)&sin_multicast, sizeof( sin_multicast ) ) < 0 )
-				{
-					fprintf( stderr, "WARNING: Could not repeat as MDNS request\n" );
-					close( socks_to_send );
-					exit( 0 );
-				}
+static void ReloadSignal( int sig )
+{
+	reload_requested = 1;
+}
+#endif
 
-				for( ;; )
-				{
-					r = recv( socks_to_send, buffer, sizeof(buffer), 0 );
-					if( r <= 0 )
-						break;
-
-					// If the packet is a reply, not a question, we can forward it back to the asker.
-					uint16_t flags = ntohs( ((uint16_t*)buffer)[1] );
-					if( ( flags & 0x8000 ) )
-						sendto( sock, buffer, r, MSG_NOSIGNAL, (struct sockaddr*)&sender, sl );
-				}
+#ifndef DISABLE_TRACE
+static void TraceDumpSignal( int sig )
+{
+	trace_dump_requested = 1;
+}
+#endif
 
-				close( socks_to_send );
-				exit( 0 );
-			}
-		}
-		else
-		{
-			// We want to make them go away.
-			uint16_t * psr = (uint16_t*)buffer;
-			//  psr[0] is the transaction ID
-			psr[1] = 0x8100; // If we wanted, we could set this to be 0x8103, to say "no such name" - but then if there's an AAAA query as well, that will cancel out an A query.
-			// Send the packet back at them.
-			sendto( sock, buffer, r, MSG_NOSIGNAL, (struct sockaddr*)&sender, sl );
-		}
-	}
-	return;
+// With tracing on, transmit timestamps come back through the error queue, which
+// shows up as POLLERR.  Only treat it as a fault if that isn't what it was.
+static int IsSocketFault( int sock, int revents )
+{
+	if( revents & POLLHUP ) return 1;
+	if( !( revents & POLLERR ) ) return 0;
+	return !( trace_enabled && TraceDrainErrQueue( sock ) > 0 );
 }
 
 int main( int argc, char *argv[] )
 {
 	int c;
-	while ( ( c = getopt (argc, argv, "r4h:" ) ) != -1 )
+	static struct mdns_netns host_netns = { .nsfd = -1, .hostname_watch = -1 };
+	netns[num_netns++] = &host_netns;
+	ns = &host_netns;
+
+	while ( ( c = getopt (argc, argv, "r4sh:T:t:n:Nc:" ) ) != -1 )
 	{
 		switch (c)
 		{
 		case 'h':
-			hostname_override = optarg;
+			args.hostname = optarg;
 			break;
+#ifndef DISABLE_RESOLVER
 		case 'r':
-			resolver = socket( AF_INET, SOCK_DGRAM, 0 );
+			args.resolver = 1;
 			break;
+#endif
 		case '4':
-			is_ipv4_only = 1;
+			args.ipv4_only = 1;
+			break;
+#ifndef DISABLE_NSS
+		case 's':
+			args.nss = 1;
+			break;
+#endif
+#ifndef DISABLE_CONFIG
+		case 'c':
+			config_path = optarg;
+			break;
+#endif
+#ifndef DISABLE_TRACE
+		case 'T':
+			trace_path = optarg;
+			break;
+#endif
+		case 't':
+			if( ParseTTL( optarg, &args.ttl ) < 0 )
+			{
+				fprintf( stderr, "Error: TTL must be from 1 to %d seconds\n", MAX_TTL );
+				return -5;
+			}
+			break;
+#ifndef DISABLE_NETNS
+		case 'n':
+			if( args.num_netns >= MAX_NETNS - 1 )
+			{
+				fprintf( stderr, "Error: Too many namespaces\n" );
+				return -5;
+			}
+			args.netns[args.num_netns++] = optarg;
 			break;
+		case 'N':
+			args.netns_all = 1;
+			break;
+#endif
 		default:
 		case '?':
-			fprintf( stderr, "Error: Usage: minimdnsd [-r] [-h hostname override]\n" );
+			fprintf( stderr, "Error: Usage: minimdnsd [-r] [-4] [-s] [-h hostname override] [-t ttl] [-T trace file] [-n netns] [-N] [-c config file]\n" );
 			return -5;
 		}
 	}
 
+	if( LoadConfig( &config ) < 0 )
+	{
+		fprintf( stderr, "FATAL: Could not load configuration\n" );
+		return -5;
+	}
+	ns->responder.ttl = config.ttl;
+	ns->responder.is_ipv4_only = config.ipv4_only;
+
 	sin_multicast.sin_port = htons( MDNS_PORT );
 
 	ReloadHostname();
 
-	int inotifyfd = inotify_init1( IN_NONBLOCK );
+	inotifyfd = inotify_init1( IN_NONBLOCK );
 
-	if( !hostname_override )
+	if( !config.hostname )
 	{
-		hostname_watch = inotify_add_watch( inotifyfd, "/etc/hostname", IN_MODIFY | IN_CREATE );
-		if( hostname_watch < 0 )
-		{
-			fprintf( stderr, "WARNING: inotify cannot watch file\n" );
-		}
+		WatchHostname();
 	}
 
-	if( resolver < 0 )
-	{
-		fprintf( stderr, "FATAL: Resolver requested but unavailable.\n" );
+#ifndef DISABLE_RESOLVER
+	if( config.resolver && OpenResolver() < 0 )
 		return -5;
-	}
-
-	if( resolver )
-	{
-		// The resolver uses child processes.  To clean up zombies, we catch SIGCHILD.
-		//signal( SIGCHLD, &ChildProcessComplete );
-
-		int optval = 1;
-		if ( setsockopt( resolver, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof( optval ) ) != 0 )
-		{
-			fprintf( stderr, "WARNING: Could not set SO_REUSEPORT on resolver\n" );
-			return -5;
-		}
-		struct sockaddr_in sin_resolve = {
-			.sin_family = AF_INET,
-			.sin_addr = { inet_addr( RESOLVER_IP ) },
-			.sin_port = htons( RESOLVER_PORT )
-		};
-		if ( bind( resolver, (struct sockaddr *)&sin_resolve, sizeof(sin_resolve) ) == -1 )
-		{
-			fprintf( stderr, "FATAL: Could not bind to IPv4 MDNS port (%d %s)\n", errno, strerror( errno ) );
-			return -5;
-		}
-		printf( "Resolver configured on \"%s\"\n", RESOLVER_IP );
-	}
-
-#ifndef DISABLE_IPV6
-	if( !is_ipv4_only )
-	{
-		sdsock = socket( AF_INET6, SOCK_DGRAM, 0 );
-		if ( sdsock < 0 )
-		{
-			fprintf( stderr, "WARNING: Opening IPv6 datagram socket error.  Trying IPv4");
-			sdsock = socket( AF_INET, SOCK_DGRAM, 0 );
-			is_bound_6 = 0;
-		}
-		else
-		{
-			is_bound_6 = 1;
-		}
-	}
-	else
-	{
-#endif
-	sdsock = socket( AF_INET, SOCK_DGRAM, 0 );
-	if ( sdsock < 0 )
-	{
-		fprintf( stderr, "FATAL: Could not open IPv4 Socket\n");
-	}
-#ifndef DISABLE_IPV6
-	}
 #endif
 
-	// Not just avahi, but other services, too will bind to 5353, but we can use
-	// SO_REUSEPORT to allow multiple people to bind simultaneously.
-	int optval = 1;
-	if ( setsockopt( sdsock, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof( optval ) ) != 0 )
-	{
-		fprintf( stderr, "WARNING: Could not set SO_REUSEPORT\n" );
-	}
-
-	if ( setsockopt( sdsock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof( optval ) ) != 0 )
-	{
-		fprintf( stderr, "WARNING: Could not set SO_REUSEADDR\n" );
-	}
+	int r = OpenMDNSSockets();
+	if( r < 0 )
+		return r;
 
-	// We have to enable PKTINFO so we can use recvmsg, so we can get desination address
-	// so we can reply accordingly.
-	if( setsockopt( sdsock, IPPROTO_IP, IP_PKTINFO, &optval, sizeof( optval ) ) != 0 )
-	{
-		fprintf( stderr, "Fatal: OS Does not support IP_PKTINFO on IPv6 socket.\n" );
-		return -9;
-	}
+#ifndef DISABLE_NSS
+	if( config.nss )
+		nss_listener = OpenNSSListener();
+#endif
 
-#ifndef DISABLE_IPV6
-	if( is_bound_6 && setsockopt( sdsock, IPPROTO_IPV6, IPV6_RECVPKTINFO, &optval, sizeof( optval ) ) != 0 )
-	{
-		fprintf( stderr, "Fatal: OS Does not support IP_PKTINFO on IPv6 socket.\n" );
-		return -9;
-	}
+#ifdef MDNS_LOOKUPS
+	AllocateCache();
 #endif
 
-	sdifaceupdown = socket( PF_NETLINK, SOCK_RAW, NETLINK_ROUTE );
-	if ( sdifaceupdown < 0 )
-	{
-		fprintf( stderr, "WARNING: Couldn't open socket for monitoring address changes.\n");
-	}
-	else
-	{
-		// Bind looking for interface changes.
-		struct sockaddr_nl addr;
-		memset(&addr, 0, sizeof(addr));
-		addr.nl_family = AF_NETLINK;
-		addr.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
-		if (bind( sdifaceupdown, (struct sockaddr *)&addr, sizeof(addr)) == -1)
-		{
-			fprintf( stderr, "WARNING: couldn't bind looking for address changes\n" );
-			close( sdifaceupdown );
-			sdifaceupdown = -1;
-		}
-	}
+	sigset_t blocked;
+	sigemptyset( &blocked );
+	sigaddset( &blocked, SIGTERM );
+	sigaddset( &blocked, SIGINT );
+	sigaddset( &blocked, SIGHUP );
+	sigaddset( &blocked, SIGUSR1 );
+	sigprocmask( SIG_BLOCK, &blocked, &poll_sigmask );
 
-	// Bind the normal MDNS socket
-#ifndef DISABLE_IPV6
-	if( is_bound_6 )
+#ifndef DISABLE_TRACE
+	if( trace_path )
 	{
-		struct sockaddr_in6 sin6 = {
-			.sin6_family = AF_INET6,
-			.sin6_addr = IN6ADDR_ANY_INIT,
-			.sin6_port = htons( MDNS_PORT )
-		};
-		if ( bind( sdsock, (struct sockaddr *)&sin6, sizeof(sin6) ) == -1 )
-		{
-			fprintf( stderr, "FATAL: Could not bind to IPv6 MDNS port (%d %s)\n", errno, strerror( errno ) );
-			exit(-1);
-		}
+		// The resolver's sockets were done as they were opened.
+		TraceEnable( ns->sdsock );
+		signal( SIGUSR1, TraceDumpSignal );
+		printf( "Tracing, send SIGUSR1 to write \"%s\"\n", trace_path );
 	}
-	else
 #endif
-	{
-		struct sockaddr_in sin = {
-			.sin_family = AF_INET,
-			.sin_addr = { INADDR_ANY },
-			.sin_port = htons( MDNS_PORT )
-		};
-		if ( bind( sdsock, (struct sockaddr *)&sin, sizeof(sin) ) == -1 )
-		{
-			fprintf( stderr, "FATAL: Could not bind to IPv4 MDNS port (%d %s)\n", errno, strerror( errno ) );
-			exit(-1);
-		}
-	}
 
 	// Some things online recommend using IPPROTO_IP, IP_MULTICAST_LOOP
 	// But, we can just ignore the replies.
 
-	int r;
 	do
 	{
 		int failcount = 0;
@@ -875,84 +2215,263 @@ int main( int argc, char *argv[] )
 		}
 	} while ( r != 0 );
 
+	signal( SIGTERM, ExitSignal );
+	signal( SIGINT, ExitSignal );
+#ifndef DISABLE_CONFIG
+	signal( SIGHUP, ReloadSignal );
+#endif
+
+	srand( getpid() ^ NowMS() );
+	RefreshInterfaces();
+	StartProbing();
+
+#ifndef DISABLE_NETNS
+	if( config.netns_all || config.num_netns )
+	{
+		if( StartNetns() < 0 )
+			return -5;
+		ScanNetns();
+	}
+#endif
+
 	while ( 1 )
 	{
-		struct pollfd fds[4] = {
-			{ .fd = sdsock, .events = POLLIN | POLLHUP | POLLERR, .revents = 0 },
-			{ .fd = sdifaceupdown, .events = POLLIN | POLLHUP | POLLERR, .revents = 0 },
+		struct pollfd fds[6+MAX_CONNS+2*MAX_NETNS] = {
 			{ .fd = inotifyfd, .events = POLLIN, .revents = 0 },
 			{ .fd = resolver, .events = POLLIN | POLLHUP | POLLERR, .revents = 0 },
+			{ .fd = resolver6, .events = POLLIN | POLLHUP | POLLERR, .revents = 0 },
+			{ .fd = resolver_tcp, .events = POLLIN, .revents = 0 },
+			{ .fd = resolver6_tcp, .events = POLLIN, .revents = 0 },
+			{ .fd = nss_listener, .events = POLLIN, .revents = 0 },
 		};
 
-		int polls = resolver ? 4 : 3;
+		int polls = 6;
+		int i;
+#ifdef MDNS_LOOKUPS
+		for( i = 0; i < MAX_CONNS; i++ )
+		{
+			// While a lookup is waiting, there may not be room for more queries.
+			struct resolver_conn * conn = resolver_conns[i];
+			fds[polls].fd = conn ? conn->sock : -1;
+			fds[polls].events = ( conn && conn->len < sizeof( conn->buf ) ) ? POLLIN : 0;
+			fds[polls++].revents = 0;
+		}
+#endif
+
+		// Each namespace's MDNS socket, then its netlink socket.
+		struct pollfd * netns_fds = &fds[polls];
+		int polled_netns = num_netns;
+		for( i = 0; i < polled_netns; i++ )
+		{
+			fds[polls++] = (struct pollfd){ .fd = netns[i]->sdsock, .events = POLLIN | POLLHUP | POLLERR };
+			fds[polls++] = (struct pollfd){ .fd = netns[i]->sdifaceupdown, .events = POLLIN | POLLHUP | POLLERR };
+		}
+
+		// Make poll wait for literally forever, unless we are probing or
+		// announcing, or have TCP clients to time out.
+		int timeout = -1;
+#ifdef MDNS_LOOKUPS
+		UseNetns( netns[0] );
+		timeout = ExpireResolverConns();
+#endif
+		for( i = 0; i < polled_netns; i++ )
+		{
+			int ns_timeout = AnnounceTimeout( netns[i] );
+			if( ns_timeout >= 0 && ( timeout < 0 || ns_timeout < timeout ) )
+				timeout = ns_timeout;
+		}
+#ifndef DISABLE_NETNS
+		if( netns_retry )
+		{
+			int64_t wait = netns_retry - NowMS();
+			if( timeout < 0 || wait < timeout )
+				timeout = wait > 0 ? wait : 0;
+		}
+#endif
+		struct timespec ts = { timeout / 1000, ( timeout % 1000 ) * 1000000 };
+		r = ppoll( fds, polls, ( timeout < 0 ) ? 0 : &ts, &poll_sigmask );
+
+		if( exit_requested )
+		{
+			for( i = 0; i < num_netns; i++ )
+			{
+				UseNetns( netns[i] );
+				SendGoodbyes();
+			}
+			if( nss_listener >= 0 )
+				unlink( MINIMDNSD_SOCKET );
+			printf( "Exiting\n" );
+			return 0;
+		}
 
-		// Make poll wait for literally forever.
-		r = poll( fds, polls, -1 );
+#ifndef DISABLE_TRACE
+		if( trace_dump_requested )
+		{
+			trace_dump_requested = 0;
+			TraceDump( trace_path );
+		}
+#endif
 
-		//printf( "%d: %d / %d / %d / %d\n", r, fds[0].revents, fds[1].revents, fds[2].revents, fds[3].revents );
+#ifndef DISABLE_CONFIG
+		// What we polled may not be there anymore, so poll again.
+		if( reload_requested )
+		{
+			reload_requested = 0;
+			ReloadConfig();
+			continue;
+		}
+#endif
 
-		if ( r < 0 )
+		if ( r < 0 && errno == EINTR )
+		{
+			continue;
+		}
+		else if ( r < 0 )
 		{
 			fprintf( stderr, "Fatal: poll = %d failed (%d %s)\n", r, errno, strerror( errno ) );
 			return -10;
 		}
 
-		if ( fds[0].revents )
+		// Backwards, so a namespace that has to go doesn't move the ones left to do.
+		for( i = polled_netns - 1; i >= 0; i-- )
 		{
-			if ( fds[0].revents & POLLIN )
+			struct pollfd * nsfds = &netns_fds[2*i];
+			if( !nsfds[0].revents && !nsfds[1].revents ) continue;
+
+			UseNetns( netns[i] );
+			if ( nsfds[0].revents & POLLIN )
+			{
+				HandleRX( ns->sdsock, 0 );
+			}
+			if ( nsfds[1].revents & POLLIN )
 			{
-				HandleRX( sdsock, 0 );
+				HandleNetlinkData( );
 			}
 
-			if( fds[0].revents & ( POLLHUP | POLLERR ) )
+			int fault = IsSocketFault( ns->sdsock, nsfds[0].revents ) || ( nsfds[1].revents & ( POLLHUP | POLLERR ) );
+			if( fault && i == 0 )
 			{
-				fprintf( stderr, "Fatal: IPv6 socket experienced fault.  Aborting\n" );
+				fprintf( stderr, "Fatal: %s socket experienced fault.  Aborting\n", ( nsfds[0].revents & ( POLLHUP | POLLERR ) ) ? "IPv6" : "NETLINK" );
 				return -14;
 			}
+#ifndef DISABLE_NETNS
+			else if( fault )
+			{
+				// Try again from scratch, if it is still there.
+				fprintf( stderr, "WARNING: Socket fault in netns \"%s\"\n", ns->name );
+				RemoveNetns( i );
+				netns_retries = 0;
+				netns_retry = NowMS() + NETNS_RETRY_MS;
+			}
+#endif
+		}
+
+		if ( fds[0].revents )
+		{
+			char evbuf[sizeof( struct inotify_event ) + NAME_MAX + 1] __attribute__((aligned(__alignof__(struct inotify_event))));
+			int len;
+			while( ( len = read( inotifyfd, evbuf, sizeof( evbuf ) ) ) > 0 )
+			{
+				struct inotify_event * event;
+				for( event = (struct inotify_event *)evbuf; (char*)event < evbuf + len;
+					event = (struct inotify_event *)( (char*)event + sizeof( *event ) + event->len ) )
+				{
+					if( event->wd == netns_watch )
+					{
+						netns_retries = 0;
+						netns_retry = NowMS();
+						continue;
+					}
+					for( i = 0; i < num_netns; i++ )
+					{
+						if( netns[i]->hostname_watch != event->wd ) continue;
+						UseNetns( netns[i] );
+						HandleHostnameWritten();
+					}
+				}
+			}
+		}
+#ifndef DISABLE_NETNS
+		if( netns_retry && NowMS() >= netns_retry )
+		{
+			ScanNetns();
 		}
+#endif
 
+		// The resolver, and lookups from the NSS module, are for our own namespace.
+		UseNetns( netns[0] );
+#ifndef DISABLE_RESOLVER
 		if ( fds[1].revents )
 		{
 			if ( fds[1].revents & POLLIN )
 			{
-				HandleNetlinkData( );
+				HandleRX( resolver, 1 );
 			}
-			if( fds[1].revents & ( POLLHUP | POLLERR ) )
+
+			if ( IsSocketFault( resolver, fds[1].revents ) )
 			{
-				fprintf( stderr, "Fatal: NETLINK socket experienced fault.  Aborting\n" );
+				fprintf( stderr, "Fatal: resolver socket experienced fault.  Aborting\n" );
 				return -14;
 			}
 		}
-
 		if ( fds[2].revents )
 		{
-			struct inotify_event event;
-			int r = read( inotifyfd, &event, sizeof( event ) );
-			r = r;
-			ReloadHostname();
-		}
-		if ( fds[3].revents )
-		{
-			if ( fds[3].revents & POLLIN )
+			if ( fds[2].revents & POLLIN )
 			{
-				HandleRX( resolver, 1 );
+				HandleRX( resolver6, 1 );
 			}
 
-			if ( fds[3].revents & ( POLLHUP | POLLERR ) )
+			if ( IsSocketFault( resolver6, fds[2].revents ) )
 			{
-				fprintf( stderr, "Fatal: resolver socket experienced fault.  Aborting\n" );
+				fprintf( stderr, "Fatal: IPv6 resolver socket experienced fault.  Aborting\n" );
 				return -14;
 			}
 		}
+		if ( fds[3].revents & POLLIN )
+		{
+			AcceptResolverConn( resolver_tcp );
+		}
+		if ( fds[4].revents & POLLIN )
+		{
+			AcceptResolverConn( resolver6_tcp );
+		}
+#endif
+#ifndef DISABLE_NSS
+		if ( fds[5].revents & POLLIN )
+		{
+			AcceptResolverConn( nss_listener );
+		}
+#endif
+#ifdef MDNS_LOOKUPS
+		for( i = 0; i < MAX_CONNS; i++ )
+		{
+			// A connection accepted just now, into a free slot or one made
+			// free, wasn't polled.
+			if( fds[6+i].fd < 0 || !fds[6+i].revents || !resolver_conns[i] || resolver_conns[i]->sock != fds[6+i].fd ) continue;
+			if( HandleResolverConn( resolver_conns[i] ) < 0 )
+				CloseResolverConn( i );
+		}
+#endif
 
+		for( i = 0; i < num_netns; i++ )
+		{
+			if( AnnounceTimeout( netns[i] ) != 0 ) continue;
+			UseNetns( netns[i] );
+			AnnounceTick();
+		}
+
+#ifndef DISABLE_RESOLVER
 		// Cleanup any remaining zombie processes from resolver.
 		// Could also be done in a SIGCHLD signal handler, but that would
 		// Interrupt the poll.
-		if( resolver )
+		if( resolver >= 0 || resolver_children )
 		{
-			int wstat;
-			wait3( &wstat, WNOHANG, NULL );
+			int wstat, r;
+			while( ( r = wait3( &wstat, WNOHANG, NULL ) ) > 0 );
+			if( r < 0 )
+				resolver_children = 0;
 		}
+#endif
 	}
 	return 0;
 }
@@ -0,0 +1,389 @@
+//
+// MIT License
+//
+// Copyright 2024 <>< Charles Lohr
+//
+// NSS module for minimdnsd.  See LICENSE for full text.
+//
+// Lets getaddrinfo() and friends look up .local names by asking a running
+// "minimdnsd -s" over a Unix socket, instead of going through the DNS stub
+// resolver.  The daemon answers from its own records and what it has heard
+// from peers, and only goes out to the network when it hasn't.
+//
+// Install libnss_minimdnsd.so.2 next to the other NSS modules (i.e.
+// /lib/x86_64-linux-gnu) and add it to the hosts line of /etc/nsswitch.conf:
+//
+//   hosts: files minimdnsd [NOTFOUND=return] dns
+//
+// Names outside .local are left alone (UNAVAIL), so they still go on to dns.
+//
+
+#include <nss.h>
+#include <netdb.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include "mdns_engine.h"
+
+// Longer than the daemon will wait on the network.
+#define NSS_TIMEOUT_SEC 5
+
+#define MAX_NSS_ADDRS 16
+
+struct nss_answer
+{
+	int rcode;
+	int naddrs;
+	int family[MAX_NSS_ADDRS];
+	uint8_t addr[MAX_NSS_ADDRS][16];
+	int32_t ttl;
+	char ptrname[MAX_MDNS_PATH];
+};
+
+static int IsLocalName( const char * name )
+{
+	int len = strlen( name );
+	if( len && name[len-1] == '.' ) len--;
+	return len > 6 && strncasecmp( name + len - 6, ".local", 6 ) == 0;
+}
+
+static int ReadFull( int sock, uint8_t * buf, int len )
+{
+	int got = 0;
+	while( got < len )
+	{
+		int r = recv( sock, buf + got, len - got, 0 );
+		if( r < 0 && errno == EINTR ) continue;
+		if( r <= 0 ) return -1;
+		got += r;
+	}
+	return got;
+}
+
+// Sends one query, framed like DNS over TCP, and reads back the response.
+// Returns its length, or -1 if the daemon can't be reached.
+static int Ask( const char * name, int qtype, uint8_t * resp, int respmax )
+{
+	uint8_t q[2+12+MAX_MDNS_PATH+6] = { 0 };
+	uint8_t * qp = q + 2 + 12;
+	const char * n = name;
+
+	q[2+2] = 0x01; // RD, like any stub resolver
+	q[2+5] = 1;    // One question
+
+	while( *n )
+	{
+		const char * e = strchr( n, '.' );
+		int len = e ? e - n : (int)strlen( n );
+		if( len == 0 && !e ) break;
+		if( len < 1 || len > 63 || qp + len + 1 + 5 > q + sizeof( q ) ) return -1;
+		*(qp++) = len;
+		memcpy( qp, n, len );
+		qp += len;
+		n += len + ( e ? 1 : 0 );
+	}
+	*(qp++) = 0;
+	*(qp++) = qtype >> 8; *(qp++) = qtype;
+	*(qp++) = 0x00; *(qp++) = 0x01;
+
+	int qlen = qp - q - 2;
+	q[0] = qlen >> 8;
+	q[1] = qlen;
+
+	struct sockaddr_un sun = { .sun_family = AF_UNIX, .sun_path = MINIMDNSD_SOCKET };
+	struct timeval tv = { .tv_sec = NSS_TIMEOUT_SEC };
+	int sock = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+	if( sock < 0 ) return -1;
+
+	uint8_t lenbuf[2];
+	int rlen = -1;
+	if( setsockopt( sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof( tv ) ) == 0 &&
+		connect( sock, (struct sockaddr *)&sun, sizeof( sun ) ) == 0 &&
+		send( sock, q, qlen + 2, MSG_NOSIGNAL ) == qlen + 2 &&
+		ReadFull( sock, lenbuf, 2 ) == 2 )
+	{
+		rlen = ( lenbuf[0] << 8 ) | lenbuf[1];
+		if( rlen > respmax || ReadFull( sock, resp, rlen ) != rlen )
+			rlen = -1;
+	}
+	close( sock );
+	return rlen;
+}
+
+// Skips over a name.  Sets *is_qname if it's a pointer to the question,
+// which is how the daemon writes records for the name asked about.
+static uint8_t * SkipName( uint8_t * p, uint8_t * end, int * is_qname )
+{
+	*is_qname = ( end - p >= 2 && p[0] == 0xc0 && p[1] == 0x0c );
+	while( p < end )
+	{
+		if( ( *p & 0xc0 ) == 0xc0 ) return ( end - p >= 2 ) ? p + 2 : 0;
+		if( *p == 0 ) return p + 1;
+		p += *p + 1;
+	}
+	return 0;
+}
+
+// Pulls the addresses (or PTR name) for the question out of a response,
+// from the answer and additional sections both.
+static int ParseAnswer( uint8_t * resp, int len, struct nss_answer * ans )
+{
+	int i, is_qname;
+	uint8_t * end = resp + len;
+
+	memset( ans, 0, sizeof( *ans ) );
+	ans->ttl = INT32_MAX;
+	if( len < 12 ) return -1;
+	ans->rcode = resp[3] & 0x0f;
+
+	int records = ( ( resp[6] << 8 ) | resp[7] ) + ( ( resp[8] << 8 ) | resp[9] ) + ( ( resp[10] << 8 ) | resp[11] );
+	uint8_t * p = SkipName( resp + 12, end, &is_qname );
+	if( !p || end - p < 4 ) return -1;
+	p += 4;
+
+	for( i = 0; i < records; i++ )
+	{
+		p = SkipName( p, end, &is_qname );
+		if( !p || end - p < 10 ) return -1;
+		int type = ( p[0] << 8 ) | p[1];
+		int32_t ttl = ( p[4] << 24 ) | ( p[5] << 16 ) | ( p[6] << 8 ) | p[7];
+		int rdlen = ( p[8] << 8 ) | p[9];
+		uint8_t * rd = p + 10;
+		if( end - rd < rdlen ) return -1;
+		p = rd + rdlen;
+
+		if( !is_qname ) continue;
+		if( ( ( type == 1 && rdlen == 4 ) || ( type == 28 && rdlen == 16 ) ) && ans->naddrs < MAX_NSS_ADDRS )
+		{
+			ans->family[ans->naddrs] = ( type == 1 ) ? AF_INET : AF_INET6;
+			memcpy( ans->addr[ans->naddrs++], rd, rdlen );
+		}
+		else if( type == 12 && !ans->ptrname[0] )
+		{
+			// Names in PTR records from the daemon are never compressed.
+			char * o = ans->ptrname;
+			uint8_t * l = rd;
+			while( l < p && *l && *l < 64 && l + *l < p && o + *l + 1 < ans->ptrname + sizeof( ans->ptrname ) )
+			{
+				if( o != ans->ptrname ) *(o++) = '.';
+				memcpy( o, l + 1, *l );
+				o += *l;
+				l += *l + 1;
+			}
+			*o = 0;
+		}
+		else continue;
+
+		if( ttl < ans->ttl ) ans->ttl = ttl;
+	}
+	return 0;
+}
+
+static enum nss_status Lookup( const char * name, int qtype, struct nss_answer * ans, int * errnop, int * h_errnop )
+{
+	uint8_t resp[MDNS_MAX_PACKET];
+	int len = Ask( name, qtype, resp, sizeof( resp ) );
+	if( len < 0 || ParseAnswer( resp, len, ans ) < 0 )
+	{
+		*errnop = errno ? errno : EAGAIN;
+		*h_errnop = NO_RECOVERY;
+		return NSS_STATUS_UNAVAIL;
+	}
+
+	// REFUSED is the daemon saying it isn't ours to answer.
+	if( ans->rcode == 5 )
+	{
+		*errnop = ENOENT;
+		*h_errnop = NO_RECOVERY;
+		return NSS_STATUS_UNAVAIL;
+	}
+
+	if( ans->rcode != 0 || ( qtype == 12 ? !ans->ptrname[0] : !ans->naddrs ) )
+	{
+		*errnop = ENOENT;
+		*h_errnop = ( ans->rcode == 0 ) ? NO_DATA : HOST_NOT_FOUND;
+		return NSS_STATUS_NOTFOUND;
+	}
+	return NSS_STATUS_SUCCESS;
+}
+
+// Lays out a hostent in the caller's buffer, pointers first, so they're aligned.
+static enum nss_status FillHostent( const char * name, int af, const struct nss_answer * ans, const void * only_addr,
+	struct hostent * result, char * buffer, size_t buflen, int * errnop, int * h_errnop )
+{
+	int alen = ( af == AF_INET6 ) ? 16 : 4;
+	int i, n = 0;
+
+	for( i = 0; i < ans->naddrs; i++ )
+		if( ans->family[i] == af ) n++;
+	if( only_addr ) n = 1;
+
+	size_t align = ( -(uintptr_t)buffer ) & ( sizeof( char * ) - 1 );
+	size_t namelen = strlen( name ) + 1;
+	size_t need = align + sizeof( char * ) * ( 1 + n + 1 ) + n * alen + namelen;
+	if( buflen < need )
+	{
+		*errnop = ERANGE;
+		*h_errnop = NETDB_INTERNAL;
+		return NSS_STATUS_TRYAGAIN;
+	}
+
+	char ** aliases = (char **)( buffer + align );
+	char ** addr_list = aliases + 1;
+	char * data = (char *)( addr_list + n + 1 );
+
+	aliases[0] = 0;
+	for( i = 0, n = 0; only_addr ? n < 1 : i < ans->naddrs; i++ )
+	{
+		if( !only_addr && ans->family[i] != af ) continue;
+		memcpy( data, only_addr ? only_addr : ans->addr[i], alen );
+		addr_list[n++] = data;
+		data += alen;
+	}
+	addr_list[n] = 0;
+	memcpy( data, name, namelen );
+
+	result->h_name = data;
+	result->h_aliases = aliases;
+	result->h_addrtype = af;
+	result->h_length = alen;
+	result->h_addr_list = addr_list;
+	return NSS_STATUS_SUCCESS;
+}
+
+enum nss_status _nss_minimdnsd_gethostbyname4_r( const char * name, struct gaih_addrtuple ** pat,
+	char * buffer, size_t buflen, int * errnop, int * h_errnop, int32_t * ttlp )
+{
+	struct nss_answer ans;
+	int i;
+
+	if( !IsLocalName( name ) )
+	{
+		*errnop = ENOENT;
+		*h_errnop = NO_RECOVERY;
+		return NSS_STATUS_UNAVAIL;
+	}
+
+	// Asking for A gets AAAA too, as additional records.
+	enum nss_status status = Lookup( name, 1, &ans, errnop, h_errnop );
+	if( status != NSS_STATUS_SUCCESS )
+		return status;
+
+	size_t align = ( -(uintptr_t)buffer ) & ( sizeof( void * ) - 1 );
+	size_t namelen = strlen( name ) + 1;
+	if( buflen < align + ans.naddrs * sizeof( struct gaih_addrtuple ) + namelen )
+	{
+		*errnop = ERANGE;
+		*h_errnop = NETDB_INTERNAL;
+		return NSS_STATUS_TRYAGAIN;
+	}
+
+	struct gaih_addrtuple * tuples = (struct gaih_addrtuple *)( buffer + align );
+	char * hname = (char *)( tuples + ans.naddrs );
+	memcpy( hname, name, namelen );
+
+	for( i = 0; i < ans.naddrs; i++ )
+	{
+		tuples[i].next = ( i + 1 < ans.naddrs ) ? &tuples[i+1] : 0;
+		tuples[i].name = hname;
+		tuples[i].family = ans.family[i];
+		memcpy( tuples[i].addr, ans.addr[i], 16 );
+		tuples[i].scopeid = 0;
+	}
+
+	*pat = tuples;
+	if( ttlp ) *ttlp = ans.ttl;
+	return NSS_STATUS_SUCCESS;
+}
+
+enum nss_status _nss_minimdnsd_gethostbyname3_r( const char * name, int af, struct hostent * result,
+	char * buffer, size_t buflen, int * errnop, int * h_errnop, int32_t * ttlp, char ** canonp )
+{
+	struct nss_answer ans;
+
+	if( af != AF_INET && af != AF_INET6 )
+	{
+		*errnop = EAFNOSUPPORT;
+		*h_errnop = NO_RECOVERY;
+		return NSS_STATUS_UNAVAIL;
+	}
+
+	if( !IsLocalName( name ) )
+	{
+		*errnop = ENOENT;
+		*h_errnop = NO_RECOVERY;
+		return NSS_STATUS_UNAVAIL;
+	}
+
+	enum nss_status status = Lookup( name, ( af == AF_INET6 ) ? 28 : 1, &ans, errnop, h_errnop );
+	if( status != NSS_STATUS_SUCCESS )
+		return status;
+
+	int i, n = 0;
+	for( i = 0; i < ans.naddrs; i++ )
+		if( ans.family[i] == af ) n++;
+	if( !n )
+	{
+		*errnop = ENOENT;
+		*h_errnop = NO_DATA;
+		return NSS_STATUS_NOTFOUND;
+	}
+
+	status = FillHostent( name, af, &ans, 0, result, buffer, buflen, errnop, h_errnop );
+	if( status == NSS_STATUS_SUCCESS )
+	{
+		if( ttlp ) *ttlp = ans.ttl;
+		if( canonp ) *canonp = result->h_name;
+	}
+	return status;
+}
+
+enum nss_status _nss_minimdnsd_gethostbyname2_r( const char * name, int af, struct hostent * result,
+	char * buffer, size_t buflen, int * errnop, int * h_errnop )
+{
+	return _nss_minimdnsd_gethostbyname3_r( name, af, result, buffer, buflen, errnop, h_errnop, 0, 0 );
+}
+
+enum nss_status _nss_minimdnsd_gethostbyname_r( const char * name, struct hostent * result,
+	char * buffer, size_t buflen, int * errnop, int * h_errnop )
+{
+	return _nss_minimdnsd_gethostbyname3_r( name, AF_INET, result, buffer, buflen, errnop, h_errnop, 0, 0 );
+}
+
+enum nss_status _nss_minimdnsd_gethostbyaddr_r( const void * addr, socklen_t len, int af, struct hostent * result,
+	char * buffer, size_t buflen, int * errnop, int * h_errnop )
+{
+	struct nss_answer ans;
+	char name[MAX_MDNS_PATH];
+	const uint8_t * a = addr;
+	int i;
+
+	// The daemon decides which addresses are local, and refuses the rest.
+	if( af == AF_INET && len == 4 )
+		snprintf( name, sizeof( name ), "%d.%d.%d.%d.in-addr.arpa", a[3], a[2], a[1], a[0] );
+	else if( af == AF_INET6 && len == 16 )
+	{
+		char * o = name;
+		for( i = 15; i >= 0; i-- )
+			o += sprintf( o, "%x.%x.", a[i] & 0xf, a[i] >> 4 );
+		strcpy( o, "ip6.arpa" );
+	}
+	else
+	{
+		*errnop = EAFNOSUPPORT;
+		*h_errnop = NO_RECOVERY;
+		return NSS_STATUS_UNAVAIL;
+	}
+
+	enum nss_status status = Lookup( name, 12, &ans, errnop, h_errnop );
+	if( status != NSS_STATUS_SUCCESS )
+		return status;
+
+	return FillHostent( ans.ptrname, af, &ans, addr, result, buffer, buflen, errnop, h_errnop );
+}
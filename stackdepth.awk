@@ -0,0 +1,56 @@
+#!/usr/bin/awk -f
+#
+# Worst case stack depth from one function, out of the .ci call graphs gcc
+# writes with -fcallgraph-info=su.  Library functions count as 0 bytes.
+#
+#   awk -v root=HandleRX -f stackdepth.awk *.ci
+#
+# Prints the total in bytes, then the deepest call chain.  If root was inlined
+# everywhere, the total is 0, so measure from its caller instead.
+#
+
+/^node:/ && / bytes \(/ {
+	title = $0; sub( /.*title: "/, "", title ); sub( /".*/, "", title )
+	bytes = $0; sub( / bytes \(.*/, "", bytes ); sub( /.*\\n/, "", bytes )
+	frame[Name( title )] = bytes + 0
+}
+
+/^edge:/ {
+	src = $0; sub( /.*sourcename: "/, "", src ); sub( /".*/, "", src )
+	dst = $0; sub( /.*targetname: "/, "", dst ); sub( /".*/, "", dst )
+	calls[Name( src )] = calls[Name( src )] " " Name( dst )
+}
+
+# Static functions are "file.c:Name", everything else just "Name".
+function Name( title ) {
+	sub( /.*:/, "", title )
+	return title
+}
+
+function Depth( fn,    n, i, list, d, best ) {
+	if( fn in depth ) return depth[fn]
+	if( visiting[fn] ) return 0 # Recursion, which we don't do.
+	visiting[fn] = 1
+	best = 0
+	n = split( calls[fn], list, " " )
+	for( i = 1; i <= n; i++ ) {
+		d = Depth( list[i] )
+		if( d > best ) { best = d; deepest[fn] = list[i] }
+	}
+	visiting[fn] = 0
+	depth[fn] = frame[fn] + best
+	return depth[fn]
+}
+
+END {
+	# If gcc only kept a specialized copy, i.e. HandleRX.constprop.0, use that.
+	if( !( root in frame ) )
+		for( fn in frame )
+			if( index( fn, root "." ) == 1 ) root = fn
+	total = Depth( root )
+	chain = root
+	for( fn = root; fn in deepest; fn = deepest[fn] )
+		chain = chain " > " deepest[fn]
+	print total
+	print chain
+}